@@ -0,0 +1,791 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Block-level deduplicating store of tape images.
+ *
+ * A store is a directory holding
+ *	blocks		each distinct block payload once, back to back
+ *	blocks.tab	where each payload is, with its XXH64 hash
+ *	name.tapd	one per image: the list of its blocks
+ * Successive dumps of the same system share most of their blocks, so
+ * each image after the first adds little to the store.
+ *
+ * An image's list has an entry per SIMH block or tapemark, and one for
+ * each run of bytes that isn't a well-formed block (an end of medium
+ * marker, or damage), so the image can be read back byte for byte.
+ * tap_open reads a list as the image it describes, returning blocks in
+ * place from the mapped blocks file, so every operation works on it
+ * without rebuilding the image.  A store is meant to be kept, so its
+ * files are little-endian.
+ */
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "blkstore.h"
+#include "cdctap.h"
+#include "hash.h"
+
+#define BS_MAGIC	"CDCTBLK1"
+#define BS_HDRSZ	24		/* magic, image size, # entries */
+#define BS_ENTSZ	16		/* offset, length, kind, pad byte */
+#define BS_TABSZ	24		/* hash, offset, length */
+#define BS_RAWMAX	65536		/* longest run of unparsed bytes */
+
+/* list entry kinds */
+#define BE_BLOCK	0		/* header, data, trailer */
+#define BE_PADDED	1		/* header, data, padding, trailer */
+#define BE_MARK		2		/* tapemark */
+#define BE_RAW		3		/* bytes as they are */
+
+typedef struct {
+	off_t		be_off;		/* payload in blocks file */
+	off_t		be_voff;	/* offset in image */
+	uint32_t	be_len;		/* payload bytes */
+	uint8_t		be_kind;
+	uint8_t		be_pad;		/* padding byte, if BE_PADDED */
+} bsent_t;
+
+struct blkstore {
+	char		*bs_map;	/* blocks file */
+	off_t		bs_mapsize;
+	bsent_t		*bs_ent;
+	size_t		bs_nent;
+	size_t		bs_cur;		/* entry last read */
+	unsigned char	bs_syn[8];	/* header or trailer made up */
+};
+
+/* blocks.tab, in memory: payloads by hash, for archiving */
+typedef struct {
+	uint64_t	bb_hash;
+	off_t		bb_off;
+	uint32_t	bb_len;
+} bsblk_t;
+
+static bsblk_t *bs_blk;
+static size_t bs_nblk, bs_maxblk;
+static size_t *bs_slot;		/* open hash table of bs_blk + 1, 0=free */
+static size_t bs_nslot;
+
+
+static uint64_t get_le(unsigned char *p, int n)
+{
+	uint64_t v = 0;
+
+	while (n--)
+		v = v << 8 | p[n];
+	return v;
+}
+
+
+static void put_le(unsigned char *p, uint64_t v, int n)
+{
+	for (; n--; v >>= 8)
+		*p++ = v;
+}
+
+
+/* bytes of image an entry stands for */
+static off_t bs_vsize(bsent_t *be)
+{
+	switch (be->be_kind) {
+	    case BE_BLOCK:	return be->be_len + 8;
+	    case BE_PADDED:	return be->be_len + 9;
+	    case BE_MARK:	return 4;
+	}
+	return be->be_len;
+}
+
+
+/* is the file open on fd an image list? */
+int bs_is_list(int fd)
+{
+	char magic[8];
+
+	return pread(fd, magic, sizeof magic, 0) == sizeof magic &&
+	       memcmp(magic, BS_MAGIC, sizeof magic) == 0;
+}
+
+
+/*
+ * Read image list fp, named path, and map its store's blocks file.
+ * *sizep gets the size of the image.
+ * returns NULL if error
+ */
+struct blkstore *bs_open(FILE *fp, char *path, off_t *sizep)
+{
+	struct blkstore *bs;
+	unsigned char hdr[BS_HDRSZ], ent[BS_ENTSZ];
+	char *rp, *bpath = NULL;
+	bsent_t *be;
+	off_t voff = 0;
+	struct stat st;
+	size_t n;
+	int fd;
+
+	bs = calloc(1, sizeof(struct blkstore));
+	if (!bs)
+		goto nomem;
+	if (fread(hdr, sizeof hdr, 1, fp) != 1)
+		goto bad;
+	bs->bs_nent = get_le(hdr + 16, 8);
+	bs->bs_ent = malloc((bs->bs_nent + 1) * sizeof(bsent_t));
+	if (!bs->bs_ent)
+		goto nomem;
+
+	/* the blocks are beside the list, wherever it's linked from */
+	if (!(rp = realpath(path, NULL)))
+		goto bad;
+	bpath = malloc(strlen(rp) + 8);
+	if (!bpath) {
+		free(rp);
+		goto nomem;
+	}
+	sprintf(bpath, "%s/blocks", dirname(rp));
+	free(rp);
+	if ((fd = open(bpath, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(bpath);
+		if (fd >= 0)
+			close(fd);
+		goto fail;
+	}
+	bs->bs_mapsize = st.st_size;
+	if (st.st_size > 0) {
+		bs->bs_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+				  fd, 0);
+		if (bs->bs_map == MAP_FAILED) {
+			perror(bpath);
+			bs->bs_map = NULL;
+			close(fd);
+			goto fail;
+		}
+		(void) madvise(bs->bs_map, st.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	for (n = 0; n < bs->bs_nent; n++) {
+		if (fread(ent, sizeof ent, 1, fp) != 1)
+			goto bad;
+		be = &bs->bs_ent[n];
+		be->be_off = get_le(ent, 8);
+		be->be_len = get_le(ent + 8, 4);
+		be->be_kind = ent[12];
+		be->be_pad = ent[13];
+		be->be_voff = voff;
+		if (be->be_kind > BE_RAW ||
+		    be->be_kind != BE_MARK &&
+		    (be->be_len == 0 || be->be_off < 0 ||
+		     be->be_off + be->be_len > bs->bs_mapsize))
+			goto bad;
+		voff += bs_vsize(be);
+	}
+	if (voff != (off_t)get_le(hdr + 8, 8))
+		goto bad;
+
+	dprint(("bs_open: %s: %lu entries, %ld bytes, store %s\n", path,
+		(unsigned long)bs->bs_nent, (long)voff, bpath));
+	free(bpath);
+	*sizep = voff;
+	return bs;
+
+    bad:
+	fprintf(stderr, "%s: damaged image list\n", path);
+	goto fail;
+    nomem:
+	fprintf(stderr, "%s: out of memory\n", path);
+    fail:
+	free(bpath);
+	bs_close(bs);
+	return NULL;
+}
+
+
+void bs_close(struct blkstore *bs)
+{
+	if (!bs)
+		return;
+	if (bs->bs_map)
+		munmap(bs->bs_map, bs->bs_mapsize);
+	free(bs->bs_ent);
+	free(bs);
+}
+
+
+/* entry holding image offset off, NULL if past the end */
+static bsent_t *bs_find(struct blkstore *bs, off_t off)
+{
+	bsent_t *be = &bs->bs_ent[bs->bs_cur];
+	size_t lo, hi, mid;
+
+	if (!bs->bs_nent)
+		return NULL;
+
+	/* nearly always the entry last used or the next one */
+	if (off >= be->be_voff) {
+		if (off < be->be_voff + bs_vsize(be))
+			return be;
+		if (bs->bs_cur + 1 < bs->bs_nent &&
+		    off < be[1].be_voff + bs_vsize(&be[1])) {
+			bs->bs_cur++;
+			return &be[1];
+		}
+	}
+
+	lo = 0;
+	hi = bs->bs_nent - 1;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (bs->bs_ent[mid].be_voff <= off)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	be = &bs->bs_ent[lo];
+	if (off < be->be_voff || off >= be->be_voff + bs_vsize(be))
+		return NULL;
+	bs->bs_cur = lo;
+	return be;
+}
+
+
+/*
+ * Get n bytes of the image at offset off: in place if they're all in
+ * one payload, else copied to dst.
+ * returns NULL if fewer than n bytes remain
+ */
+unsigned char *bs_get(struct blkstore *bs, off_t off, unsigned char *dst,
+		      size_t n)
+{
+	unsigned char *p;
+	size_t got, avail;
+	bsent_t *be;
+	off_t rel;
+	int made;
+
+	for (got = 0; got < n; got += avail) {
+		if (!(be = bs_find(bs, off + got)))
+			return NULL;
+		rel = off + got - be->be_voff;
+
+		made = be->be_kind != BE_RAW;
+		if (be->be_kind == BE_MARK) {
+			memset(bs->bs_syn, 0, 4);
+			p = bs->bs_syn + rel;
+			avail = 4 - rel;
+		} else if (be->be_kind == BE_RAW) {
+			p = (unsigned char *)bs->bs_map + be->be_off + rel;
+			avail = be->be_len - rel;
+		} else if (rel < 4) {
+			put_le(bs->bs_syn, be->be_len, 4);
+			p = bs->bs_syn + rel;
+			avail = 4 - rel;
+		} else if (rel < 4 + be->be_len) {
+			p = (unsigned char *)bs->bs_map + be->be_off + rel - 4;
+			avail = 4 + be->be_len - rel;
+			made = 0;
+		} else {
+			/* padding byte, if any, and trailer */
+			rel -= 4 + be->be_len;
+			p = bs->bs_syn;
+			if (be->be_kind == BE_PADDED)
+				*p++ = be->be_pad;
+			put_le(p, be->be_len, 4);
+			avail = p + 4 - bs->bs_syn - rel;
+			p = bs->bs_syn + rel;
+		}
+
+		/* all from the map: no need to copy */
+		if (!got && avail >= n && !made)
+			return p;
+		avail = MIN(avail, n - got);
+		memcpy(dst + got, p, avail);
+	}
+	return dst;
+}
+
+
+/* index payload k of bs_blk by its hash */
+static void bs_hashin(size_t k)
+{
+	size_t i = bs_blk[k].bb_hash & (bs_nslot - 1);
+
+	while (bs_slot[i])
+		i = (i + 1) & (bs_nslot - 1);
+	bs_slot[i] = k + 1;
+}
+
+
+/* make room for one more payload */
+/* returns -1 if out of memory */
+static int bs_grow(void)
+{
+	bsblk_t *nb;
+	size_t *ns, k;
+
+	if (bs_nblk == bs_maxblk) {
+		bs_maxblk = bs_maxblk ? bs_maxblk * 2 : 4096;
+		nb = realloc(bs_blk, bs_maxblk * sizeof(bsblk_t));
+		if (!nb)
+			return -1;
+		bs_blk = nb;
+	}
+
+	/* keep the hash table at most half full */
+	if ((bs_nblk + 1) * 2 > bs_nslot) {
+		ns = calloc(bs_nslot ? bs_nslot * 2 : 8192, sizeof(size_t));
+		if (!ns)
+			return -1;
+		free(bs_slot);
+		bs_slot = ns;
+		bs_nslot = bs_nslot ? bs_nslot * 2 : 8192;
+		for (k = 0; k < bs_nblk; k++)
+			bs_hashin(k);
+	}
+	return 0;
+}
+
+
+/* archiving state for one store */
+typedef struct {
+	char		*as_dir;
+	int		as_fd;		/* blocks file */
+	off_t		as_end;		/* its size */
+	int		as_tfd;		/* blocks.tab */
+	unsigned char	*as_tab;	/* table entries not yet written */
+	size_t		as_ntab, as_maxtab;
+	char		*as_cmp;	/* for comparing payloads */
+	size_t		as_cmpsize;
+	unsigned char	*as_ent;	/* list of image being added */
+	size_t		as_nent, as_maxent;
+	unsigned long	as_nnew;
+	off_t		as_added;
+} bsarch_t;
+
+
+/*
+ * Find payload in the store, adding it if it's new.
+ * returns its offset in the blocks file, -1 if error
+ */
+static off_t bs_store(bsarch_t *as, unsigned char *buf, uint32_t len)
+{
+	unsigned char *te;
+	bsblk_t *bb;
+	digest_t d;
+	hash_t h;
+	size_t i, max;
+
+	if (bs_grow() < 0)
+		goto nomem;
+	hash_init(&h, HASH_FAST);
+	hash_update(&h, buf, len);
+	hash_final(&h, &d);
+
+	/* same hash and length: compare, since the image must come back */
+	for (i = d.hd_fast & (bs_nslot - 1); bs_slot[i];
+	     i = (i + 1) & (bs_nslot - 1)) {
+		bb = &bs_blk[bs_slot[i] - 1];
+		if (bb->bb_hash != d.hd_fast || bb->bb_len != len)
+			continue;
+		if (len > as->as_cmpsize) {
+			free(as->as_cmp);
+			as->as_cmpsize = 0;
+			if (!(as->as_cmp = malloc(len)))
+				goto nomem;
+			as->as_cmpsize = len;
+		}
+		if (pread(as->as_fd, as->as_cmp, len, bb->bb_off) == len &&
+		    memcmp(as->as_cmp, buf, len) == 0)
+			return bb->bb_off;
+	}
+
+	if (as->as_ntab == as->as_maxtab) {
+		max = as->as_maxtab ? as->as_maxtab * 2 : 4096;
+		te = realloc(as->as_tab, max * BS_TABSZ);
+		if (!te)
+			goto nomem;
+		as->as_tab = te;
+		as->as_maxtab = max;
+	}
+	if (pwrite(as->as_fd, buf, len, as->as_end) != len) {
+		fprintf(stderr, "%s/blocks: ", as->as_dir);
+		perror("write");
+		return -1;
+	}
+
+	bb = &bs_blk[bs_nblk];
+	bb->bb_hash = d.hd_fast;
+	bb->bb_off = as->as_end;
+	bb->bb_len = len;
+	bs_hashin(bs_nblk++);
+	te = as->as_tab + as->as_ntab++ * BS_TABSZ;
+	put_le(te, bb->bb_hash, 8);
+	put_le(te + 8, bb->bb_off, 8);
+	put_le(te + 16, len, 8);
+
+	as->as_end += len;
+	as->as_nnew++;
+	as->as_added += len;
+	return bb->bb_off;
+
+    nomem:
+	fprintf(stderr, "%s: out of memory\n", as->as_dir);
+	return -1;
+}
+
+
+/* add an entry to the image's list, and its payload to the store */
+/* returns -1 if error */
+static int bs_entry(bsarch_t *as, int kind, unsigned char *buf,
+		    uint32_t len, int pad)
+{
+	unsigned char *ne;
+	off_t off = 0;
+	size_t max;
+
+	if (as->as_nent == as->as_maxent) {
+		max = as->as_maxent ? as->as_maxent * 2 : 4096;
+		ne = realloc(as->as_ent, max * BS_ENTSZ);
+		if (!ne) {
+			fprintf(stderr, "%s: out of memory\n", as->as_dir);
+			return -1;
+		}
+		as->as_ent = ne;
+		as->as_maxent = max;
+	}
+	if (kind != BE_MARK && (off = bs_store(as, buf, len)) < 0)
+		return -1;
+
+	ne = as->as_ent + as->as_nent++ * BS_ENTSZ;
+	memset(ne, 0, BS_ENTSZ);
+	put_le(ne, off, 8);
+	put_le(ne + 8, len, 4);
+	ne[12] = kind;
+	ne[13] = pad;
+	return 0;
+}
+
+
+/* write the image's list as dir/name.tapd, or name.1.tapd etc. */
+/* returns name written, NULL if error */
+static char *bs_list(bsarch_t *as, char *file, off_t size)
+{
+	unsigned char hdr[BS_HDRSZ];
+	char *base, *cp, *tmp, *lpath;
+	int i, ok;
+	FILE *fp;
+
+	base = strrchr(file, '/');
+	base = base ? base+1 : file;
+	tmp = malloc(strlen(as->as_dir) + 32);
+	lpath = malloc(strlen(as->as_dir) + strlen(base) + 32);
+	if (!tmp || !lpath) {
+		fprintf(stderr, "%s: out of memory\n", as->as_dir);
+		goto fail;
+	}
+
+	/* write under a temporary name so a reader never sees half of it */
+	sprintf(tmp, "%s/list.%ld", as->as_dir, (long)getpid());
+	if (!(fp = fopen(tmp, "w"))) {
+		perror(tmp);
+		goto fail;
+	}
+	memcpy(hdr, BS_MAGIC, 8);
+	put_le(hdr + 8, size, 8);
+	put_le(hdr + 16, as->as_nent, 8);
+	ok = fwrite(hdr, sizeof hdr, 1, fp) == 1 &&
+	     fwrite(as->as_ent, BS_ENTSZ, as->as_nent, fp) == as->as_nent;
+	if (fclose(fp) != 0 || !ok) {
+		perror(tmp);
+		goto fail;
+	}
+
+	/* name.tap becomes name.tapd, keeping any list already there */
+	sprintf(lpath, "%s/%s", as->as_dir, base);
+	cp = lpath + strlen(lpath);
+	if (cp - lpath > 4 && strcmp(cp - 4, ".tap") == 0)
+		*(cp -= 4) = '\0';
+	for (i = 0; i < 100; i++) {
+		if (i)
+			sprintf(cp, ".%d.tapd", i);
+		else
+			strcpy(cp, ".tapd");
+		if (link(tmp, lpath) == 0)
+			break;
+		if (errno != EEXIST) {
+			perror(lpath);
+			goto fail;
+		}
+	}
+	(void) unlink(tmp);
+	free(tmp);
+	if (i == 100) {
+		fprintf(stderr, "%s: too many lists of that name\n", lpath);
+		free(lpath);
+		return NULL;
+	}
+	return lpath;
+
+    fail:
+	if (tmp)
+		(void) unlink(tmp);
+	free(tmp);
+	free(lpath);
+	return NULL;
+}
+
+
+/* does the list read back as the image? */
+static int bs_verify(char *lpath, unsigned char *map, off_t size)
+{
+	struct blkstore *bs;
+	unsigned char buf[65536], *p;
+	off_t bsize, off;
+	size_t n;
+	FILE *fp;
+
+	if (!(fp = fopen(lpath, "r")))
+		return -1;
+	bs = bs_open(fp, lpath, &bsize);
+	fclose(fp);
+	if (!bs)
+		return -1;
+
+	for (off = 0; bsize == size && off < size; off += n) {
+		n = MIN(sizeof buf, size - off);
+		if (!(p = bs_get(bs, off, buf, n)) ||
+		    memcmp(p, map + off, n) != 0)
+			break;
+	}
+	bs_close(bs);
+	return bsize == size && off == size ? 0 : -1;
+}
+
+
+/*
+ * Add image file to the store.  Its blocks are new payloads, or are
+ * found among those already stored.
+ * returns 0 if done, else exit code
+ */
+static int bs_add(bsarch_t *as, char *file)
+{
+	unsigned char *map, *p;
+	off_t pos, rem, raw = -1, size;
+	struct stat st;
+	uint32_t n;
+	int fd, kind, step;
+	unsigned long nnew = as->as_nnew;
+	off_t added = as->as_added;
+	char *lpath;
+
+	if ((fd = open(file, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(file);
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+	if (!S_ISREG(st.st_mode) || bs_is_list(fd)) {
+		fprintf(stderr, "%s: not an image file\n", file);
+		close(fd);
+		return 1;
+	}
+	size = st.st_size;
+	map = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(file);
+		return 1;
+	}
+	if (size)
+		(void) madvise(map, size, MADV_SEQUENTIAL);
+
+	as->as_nent = 0;
+	for (pos = 0; pos < size; pos += step) {
+		p = map + pos;
+		rem = size - pos;
+		kind = -1;
+		n = rem >= 4 ? get_le(p, 4) : 0;
+		if (rem < 4)
+			;
+		else if (n == 0)
+			kind = BE_MARK, step = 4;
+		else if (rem >= 8 && n <= rem - 8 && get_le(p + 4 + n, 4) == n)
+			kind = BE_BLOCK, step = n + 8;
+		else if (n & 1 && rem >= 9 && n <= rem - 9 &&
+			 get_le(p + 5 + n, 4) == n)
+			kind = BE_PADDED, step = n + 9;
+
+		/* not a block: gather bytes as they are, up to the next */
+		if (kind < 0) {
+			step = 1;
+			if (raw < 0)
+				raw = pos;
+			if (pos + 1 - raw < BS_RAWMAX && pos + 1 < size)
+				continue;
+			if (bs_entry(as, BE_RAW, map + raw, pos + 1 - raw,
+				     0) < 0)
+				goto fail;
+			raw = -1;
+			continue;
+		}
+		if (raw >= 0) {
+			if (bs_entry(as, BE_RAW, map + raw, pos - raw, 0) < 0)
+				goto fail;
+			raw = -1;
+		}
+		if (bs_entry(as, kind, p + 4, n,
+			     kind == BE_PADDED ? p[4+n] : 0) < 0)
+			goto fail;
+	}
+
+	/* payloads before the table entries that point at them */
+	if (fdatasync(as->as_fd) < 0 ||
+	    write(as->as_tfd, as->as_tab, as->as_ntab * BS_TABSZ) !=
+	    as->as_ntab * BS_TABSZ || fdatasync(as->as_tfd) < 0) {
+		fprintf(stderr, "%s: ", as->as_dir);
+		perror("write");
+		goto fail;
+	}
+	as->as_ntab = 0;
+
+	if (!(lpath = bs_list(as, file, size)))
+		goto fail;
+	if (bs_verify(lpath, map, size) < 0) {
+		fprintf(stderr, "%s: doesn't read back as %s\n", lpath, file);
+		free(lpath);
+		goto fail;
+	}
+	printf("%s: %lu entries, %lu new blocks, %ld of %ld bytes added "
+	       "as %s\n", file, (unsigned long)as->as_nent,
+	       as->as_nnew - nnew, (long)(as->as_added - added), (long)size,
+	       lpath);
+	free(lpath);
+	if (map)
+		munmap(map, size);
+	return 0;
+
+    fail:
+	if (map)
+		munmap(map, size);
+	return 2;
+}
+
+
+/*
+ * -A: add images to a block store, creating it if need be.
+ */
+int bs_archive(char *store, char **files, int nfile)
+{
+	bsarch_t as;
+	unsigned char buf[BS_TABSZ * 1024], *te;
+	struct stat st;
+	char *path;
+	ssize_t n;
+	off_t ntab = 0;
+	bsblk_t *bb;
+	int i, r, ec = 0;
+
+	memset(&as, 0, sizeof as);
+	as.as_dir = store;
+	as.as_fd = as.as_tfd = -1;
+	path = malloc(strlen(store) + 16);
+	if (!path) {
+		fprintf(stderr, "%s: out of memory\n", store);
+		return 1;
+	}
+	if (mkdir(store, 0777) < 0 && errno != EEXIST) {
+		perror(store);
+		goto fail;
+	}
+
+	/* one archiver at a time; readers never need to wait */
+	sprintf(path, "%s/blocks.tab", store);
+	as.as_tfd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+	if (as.as_tfd < 0 || flock(as.as_tfd, LOCK_EX) < 0) {
+		perror(path);
+		goto fail;
+	}
+	sprintf(path, "%s/blocks", store);
+	as.as_fd = open(path, O_RDWR | O_CREAT, 0666);
+	if (as.as_fd < 0 || fstat(as.as_fd, &st) < 0) {
+		perror(path);
+		goto fail;
+	}
+
+	/* load the table, less any part of an entry from a run that died; */
+	/* payloads that run wrote are just left unused */
+	while ((n = read(as.as_tfd, buf, sizeof buf)) > 0) {
+		for (te = buf; te + BS_TABSZ <= buf + n; te += BS_TABSZ) {
+			if (bs_grow() < 0) {
+				fprintf(stderr, "%s: out of memory\n", store);
+				goto fail;
+			}
+			bb = &bs_blk[bs_nblk];
+			bb->bb_hash = get_le(te, 8);
+			bb->bb_off = get_le(te + 8, 8);
+			bb->bb_len = get_le(te + 16, 4);
+			if (bb->bb_off + bb->bb_len > st.st_size)
+				break;
+			bs_hashin(bs_nblk++);
+			ntab++;
+		}
+		if (te < buf + n)
+			break;
+	}
+	if (n < 0 || ftruncate(as.as_tfd, ntab * BS_TABSZ) < 0) {
+		perror(store);
+		goto fail;
+	}
+	as.as_end = st.st_size;
+	dprint(("bs_archive: %s: %lu blocks, %ld bytes\n", store,
+		(unsigned long)bs_nblk, (long)as.as_end));
+
+	for (i = 0; i < nfile; i++) {
+		r = bs_add(&as, files[i]);
+		ec = MAX(ec, r);
+	}
+
+	if (verbose)
+		printf("%s: %lu blocks, %ld bytes\n", store,
+		       (unsigned long)bs_nblk, (long)as.as_end);
+	goto done;
+
+    fail:
+	ec = 1;
+    done:
+	if (as.as_fd >= 0)
+		close(as.as_fd);
+	if (as.as_tfd >= 0)
+		close(as.as_tfd);
+	free(as.as_tab);
+	free(as.as_ent);
+	free(as.as_cmp);
+	free(bs_blk);
+	free(bs_slot);
+	free(path);
+	return ec;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Block-level deduplicating store of tape images.
+ */
+
+#ifndef _BLKSTORE_H
+#define _BLKSTORE_H 1
+
+#include <stdio.h>
+#include <sys/types.h>
+
+struct blkstore;
+
+extern int bs_archive(char *store, char **files, int nfile);
+extern int bs_is_list(int fd);
+extern struct blkstore *bs_open(FILE *fp, char *path, off_t *sizep);
+extern unsigned char *bs_get(struct blkstore *bs, off_t off,
+			     unsigned char *dst, size_t n);
+extern void bs_close(struct blkstore *bs);
+
+#endif /* _BLKSTORE_H */
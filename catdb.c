@@ -0,0 +1,670 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Catalog of the records in a collection of tape images.
+ *
+ * The catalog is one file: a header, a table of images, a table of
+ * records sorted by name, and the images' path names.  An image is
+ * rescanned only if its size, mtime or sampled hash (see tapidx.c) has
+ * changed.  Like the sidecar index, it is stored in host byte order.
+ */
+
+#define _GNU_SOURCE	/* FNM_CASEFOLD */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "catdb.h"
+#include "cdctap.h"
+#include "ifmt.h"
+#include "outfile.h"
+#include "pfdump.h"
+#include "rectype.h"
+#include "simtap.h"
+#include "tapidx.h"
+
+#define CAT_MAGIC	"CDCTCAT1"
+
+typedef struct {
+	char		ch_magic[8];
+	uint32_t	ch_imgsize;	/* sizeof(catimg_t) */
+	uint32_t	ch_recsize;	/* sizeof(catrec_t) */
+	uint64_t	ch_nimg;
+	uint64_t	ch_nrec;
+	uint64_t	ch_strsize;
+} cathdr_t;
+
+typedef struct {
+	int64_t		ci_size;	/* as in tapidx_t */
+	int64_t		ci_mtime;
+	int64_t		ci_mnsec;
+	uint64_t	ci_hash;
+	uint64_t	ci_path;	/* offset in string table */
+	uint64_t	ci_nrec;
+} catimg_t;
+
+typedef struct {
+	int64_t		cr_off;		/* offset of record in image */
+	uint32_t	cr_img;
+	uint32_t	cr_date;	/* yyyymmdd, 0 if none */
+	int32_t		cr_ui;		/* -1 if none */
+	int32_t		cr_reclen;
+	uint8_t		cr_rt;
+	char		cr_name[8];
+} catrec_t;
+
+/* catalog in memory */
+typedef struct {
+	catimg_t	*ct_img;
+	size_t		ct_nimg, ct_maximg;
+	catrec_t	*ct_rec;
+	size_t		ct_nrec, ct_maxrec;
+	char		*ct_str;
+	size_t		ct_strsize, ct_maxstr;
+} catalog_t;
+
+
+/* grow *pp to hold n more items of size sz */
+static int cat_grow(void **pp, size_t *maxp, size_t cur, size_t n, size_t sz)
+{
+	void *np;
+	size_t max;
+
+	if (cur + n <= *maxp)
+		return 0;
+	max = MAX(*maxp * 2, cur + n + 64);
+	if (!(np = realloc(*pp, max * sz))) {
+		fprintf(stderr, "catalog: out of memory\n");
+		return -1;
+	}
+	*pp = np;
+	*maxp = max;
+	return 0;
+}
+
+
+/* returns 0 if loaded or db doesn't exist yet, -1 if unreadable */
+static int cat_load(catalog_t *ct, char *db)
+{
+	cathdr_t ch;
+	FILE *fp;
+
+	memset(ct, 0, sizeof(catalog_t));
+	if (!(fp = fopen(db, "r")))
+		return 0;
+
+	if (fread(&ch, sizeof ch, 1, fp) != 1 ||
+	    memcmp(ch.ch_magic, CAT_MAGIC, sizeof ch.ch_magic) != 0 ||
+	    ch.ch_imgsize != sizeof(catimg_t) ||
+	    ch.ch_recsize != sizeof(catrec_t)) {
+		fprintf(stderr, "%s: not a cdctap catalog\n", db);
+		fclose(fp);
+		return -1;
+	}
+
+	if (cat_grow((void **)&ct->ct_img, &ct->ct_maximg, 0, ch.ch_nimg,
+		     sizeof(catimg_t)) < 0 ||
+	    cat_grow((void **)&ct->ct_rec, &ct->ct_maxrec, 0, ch.ch_nrec,
+		     sizeof(catrec_t)) < 0 ||
+	    cat_grow((void **)&ct->ct_str, &ct->ct_maxstr, 0, ch.ch_strsize,
+		     1) < 0) {
+		fclose(fp);
+		return -1;
+	}
+	if (fread(ct->ct_img, sizeof(catimg_t), ch.ch_nimg, fp) != ch.ch_nimg ||
+	    fread(ct->ct_rec, sizeof(catrec_t), ch.ch_nrec, fp) != ch.ch_nrec ||
+	    fread(ct->ct_str, 1, ch.ch_strsize, fp) != ch.ch_strsize) {
+		fprintf(stderr, "%s: catalog is truncated\n", db);
+		fclose(fp);
+		return -1;
+	}
+	ct->ct_nimg = ch.ch_nimg;
+	ct->ct_nrec = ch.ch_nrec;
+	ct->ct_strsize = ch.ch_strsize;
+	fclose(fp);
+	return 0;
+}
+
+
+static void cat_free(catalog_t *ct)
+{
+	free(ct->ct_img);
+	free(ct->ct_rec);
+	free(ct->ct_str);
+}
+
+
+static int cmp_rec(const void *a, const void *b)
+{
+	const catrec_t *ra = a, *rb = b;
+	int rv;
+
+	if (rv = strcmp(ra->cr_name, rb->cr_name))
+		return rv;
+	if (ra->cr_img != rb->cr_img)
+		return ra->cr_img < rb->cr_img ? -1 : 1;
+	return ra->cr_off < rb->cr_off ? -1 : ra->cr_off > rb->cr_off;
+}
+
+
+/* write catalog, leaving out the first ngone images if gone[i] is set */
+/* returns 0 if written */
+static int cat_save(catalog_t *ct, char *db, char *gone, size_t ngone)
+{
+	cathdr_t ch;
+	uint32_t *map;
+	size_t i, n, len, slen = 0;
+	char *tmp, *str;
+	FILE *fp;
+	int ok;
+
+	/* renumber surviving images, and pack their names */
+	map = malloc((ct->ct_nimg + 1) * sizeof(uint32_t));
+	str = malloc(ct->ct_strsize + 1);
+	if (!map || !str) {
+		fprintf(stderr, "catalog: out of memory\n");
+		free(map);
+		return -1;
+	}
+	for (i = n = 0; i < ct->ct_nimg; i++) {
+		if (i < ngone && gone[i]) {
+			map[i] = ~(uint32_t)0;
+			continue;
+		}
+		len = strlen(ct->ct_str + ct->ct_img[i].ci_path) + 1;
+		memcpy(str + slen, ct->ct_str + ct->ct_img[i].ci_path, len);
+		map[i] = n;
+		ct->ct_img[n] = ct->ct_img[i];
+		ct->ct_img[n++].ci_path = slen;
+		slen += len;
+	}
+	ct->ct_nimg = n;
+	free(ct->ct_str);
+	ct->ct_str = str;
+	ct->ct_strsize = ct->ct_maxstr = slen;
+	for (i = n = 0; i < ct->ct_nrec; i++) {
+		if (map[ct->ct_rec[i].cr_img] == ~(uint32_t)0)
+			continue;
+		ct->ct_rec[i].cr_img = map[ct->ct_rec[i].cr_img];
+		ct->ct_rec[n++] = ct->ct_rec[i];
+	}
+	ct->ct_nrec = n;
+	free(map);
+	qsort(ct->ct_rec, ct->ct_nrec, sizeof(catrec_t), cmp_rec);
+
+	memset(&ch, 0, sizeof ch);
+	memcpy(ch.ch_magic, CAT_MAGIC, sizeof ch.ch_magic);
+	ch.ch_imgsize = sizeof(catimg_t);
+	ch.ch_recsize = sizeof(catrec_t);
+	ch.ch_nimg = ct->ct_nimg;
+	ch.ch_nrec = ct->ct_nrec;
+	ch.ch_strsize = ct->ct_strsize;
+
+	tmp = malloc(strlen(db) + 5);
+	if (!tmp) {
+		fprintf(stderr, "catalog: out of memory\n");
+		return -1;
+	}
+	sprintf(tmp, "%s.tmp", db);
+	if (!(fp = fopen(tmp, "w"))) {
+		perror(tmp);
+		free(tmp);
+		return -1;
+	}
+	ok = fwrite(&ch, sizeof ch, 1, fp) == 1 &&
+	     fwrite(ct->ct_img, sizeof(catimg_t), ct->ct_nimg, fp) ==
+	     ct->ct_nimg &&
+	     fwrite(ct->ct_rec, sizeof(catrec_t), ct->ct_nrec, fp) ==
+	     ct->ct_nrec &&
+	     fwrite(ct->ct_str, 1, ct->ct_strsize, fp) == ct->ct_strsize;
+	if (fclose(fp) != 0 || !ok || rename(tmp, db) < 0) {
+		perror(db);
+		(void) unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+
+/* convert "yy/mm/dd" to yyyymmdd, 0 if not a date */
+static uint32_t cat_date(char *date)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof tm);
+	if (parse_date(date, &tm) < 0)
+		return 0;
+	return (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 +
+	       tm.tm_mday;
+}
+
+
+/* add image at path with the records in ix; returns 0 on success */
+static int cat_add(catalog_t *ct, char *path, tapidx_t *ix)
+{
+	catimg_t *ci;
+	catrec_t *cr;
+	idxent_t *ie;
+	size_t i, len = strlen(path) + 1;
+
+	if (cat_grow((void **)&ct->ct_img, &ct->ct_maximg, ct->ct_nimg, 1,
+		     sizeof(catimg_t)) < 0 ||
+	    cat_grow((void **)&ct->ct_rec, &ct->ct_maxrec, ct->ct_nrec,
+		     ix->ix_nent, sizeof(catrec_t)) < 0 ||
+	    cat_grow((void **)&ct->ct_str, &ct->ct_maxstr, ct->ct_strsize, len,
+		     1) < 0)
+		return -1;
+
+	ci = &ct->ct_img[ct->ct_nimg];
+	memset(ci, 0, sizeof(catimg_t));
+	ci->ci_size = ix->ix_size;
+	ci->ci_mtime = ix->ix_mtime;
+	ci->ci_mnsec = ix->ix_mnsec;
+	ci->ci_hash = ix->ix_hash;
+	ci->ci_path = ct->ct_strsize;
+	memcpy(ct->ct_str + ct->ct_strsize, path, len);
+	ct->ct_strsize += len;
+
+	for (i = 0; i < ix->ix_nent; i++) {
+		ie = &ix->ix_ent[i];
+		if (ie->ie_kind != IE_REC)
+			continue;
+		cr = &ct->ct_rec[ct->ct_nrec++];
+		memset(cr, 0, sizeof(catrec_t));
+		cr->cr_off = ie->ie_off;
+		cr->cr_img = ct->ct_nimg;
+		cr->cr_date = cat_date(ie->ie_date);
+		cr->cr_ui = ie->ie_ui;
+		cr->cr_reclen = ie->ie_reclen;
+		cr->cr_rt = ie->ie_rt;
+		memcpy(cr->cr_name, ie->ie_name, sizeof cr->cr_name);
+		ci->ci_nrec++;
+	}
+	ct->ct_nimg++;
+	return 0;
+}
+
+
+/* image already cataloged, for cat_update to sort and look up by path */
+typedef struct {
+	char		*pe_path;	/* in a copy of the string table */
+	uint32_t	pe_img;
+} pathent_t;
+
+static int cmp_path(const void *a, const void *b)
+{
+	return strcmp(((pathent_t *)a)->pe_path, ((pathent_t *)b)->pe_path);
+}
+
+static int find_path(const void *key, const void *b)
+{
+	return strcmp(key, ((pathent_t *)b)->pe_path);
+}
+
+
+/*
+ * Add or refresh images in catalog db.  A file name of "-" reads names
+ * from stdin, one per line.  sidecar says whether to use and keep each
+ * image's sidecar index.
+ * returns 0 if all images were cataloged, 2 if some were not, 1 if the
+ * catalog couldn't be read or written
+ */
+int cat_update(char *db, char **files, int nfile, int sidecar)
+{
+	catalog_t ct;
+	tapidx_t *ix;
+	TAPE *tap;
+	char *path, *file, line[PATH_MAX+1], rpath[PATH_MAX];
+	char *gone, *ostr;
+	pathent_t *sorted, *pe;
+	size_t i, nold;
+	int nadd = 0, nsame = 0, ec = 0, f = 0;
+
+	if (cat_load(&ct, db) < 0)
+		return 1;
+
+	/* images already cataloged, sorted by path; cat_add may move ct_str */
+	nold = ct.ct_nimg;
+	sorted = malloc((nold + 1) * sizeof(pathent_t));
+	gone = calloc(nold + 1, 1);
+	ostr = malloc(ct.ct_strsize + 1);
+	if (!sorted || !gone || !ostr) {
+		fprintf(stderr, "catalog: out of memory\n");
+		free(sorted);
+		free(gone);
+		free(ostr);
+		cat_free(&ct);
+		return 1;
+	}
+	if (ct.ct_strsize)
+		memcpy(ostr, ct.ct_str, ct.ct_strsize);
+	for (i = 0; i < nold; i++) {
+		sorted[i].pe_path = ostr + ct.ct_img[i].ci_path;
+		sorted[i].pe_img = i;
+	}
+	qsort(sorted, nold, sizeof(pathent_t), cmp_path);
+
+	while (f < nfile) {
+		file = files[f];
+		if (strcmp(file, "-") == 0) {
+			if (!fgets(line, sizeof line, stdin)) {
+				f++;
+				continue;
+			}
+			line[strcspn(line, "\n")] = '\0';
+			if (!line[0])
+				continue;
+			file = line;
+		} else
+			f++;
+
+		path = realpath(file, rpath) ? rpath : file;
+		pe = bsearch(path, sorted, nold, sizeof(pathent_t), find_path);
+		i = pe ? pe->pe_img : nold;
+
+		if (!(tap = tap_open(file, NULL))) {
+			perror(file);
+			ec = 2;
+			continue;
+		}
+		if (!(ix = idx_new(tap))) {
+			fprintf(stderr, "%s: not a tape image file\n", file);
+			tap_close(tap);
+			ec = 2;
+			continue;
+		}
+
+		/* unchanged since last time? */
+		if (i < nold && ct.ct_img[i].ci_size == ix->ix_size &&
+		    ct.ct_img[i].ci_mtime == ix->ix_mtime &&
+		    ct.ct_img[i].ci_mnsec == ix->ix_mnsec &&
+		    ct.ct_img[i].ci_hash == ix->ix_hash) {
+			dprint(("cat_update: %s unchanged\n", path));
+			nsame++;
+			idx_free(ix);
+			tap_close(tap);
+			continue;
+		}
+
+		/* records from the sidecar index, else scan */
+		if (sidecar) {
+			tapidx_t *sx = idx_load(tap);
+
+			if (sx) {
+				idx_free(ix);
+				ix = sx;
+			}
+		}
+		if (!ix->ix_nent) {
+			if (idx_scan(ix, tap) < 0) {
+				fprintf(stderr, "%s: unreadable, "
+						"not cataloged\n", file);
+				idx_free(ix);
+				tap_close(tap);
+				ec = 2;
+				continue;
+			}
+			if (sidecar)
+				(void) idx_save(ix);
+		}
+
+		if (verbose)
+			printf("%s: %s\n", path, i < nold ? "updated" : "added");
+		if (cat_add(&ct, path, ix) < 0) {
+			idx_free(ix);
+			tap_close(tap);
+			ec = 1;
+			break;
+		}
+		if (i < nold)
+			gone[i] = 1;
+		nadd++;
+		idx_free(ix);
+		tap_close(tap);
+	}
+
+	if (verbose)
+		printf("%d images cataloged, %d unchanged\n", nadd, nsame);
+	if (nadd && ec != 1 && cat_save(&ct, db, gone, nold) < 0)
+		ec = 1;
+	free(sorted);
+	free(gone);
+	free(ostr);
+	cat_free(&ct);
+	return ec;
+}
+
+
+/* -Q conditions */
+typedef struct {
+	char		*q_name;	/* fnmatch pattern */
+	char		q_prefix[8];	/* literal start of q_name, upper case */
+	char		*q_type;	/* record type name */
+	int		q_ui;		/* -1 = any */
+	uint32_t	q_after;	/* yyyymmdd, 0 = any */
+	uint32_t	q_before;
+	char		*q_tape;	/* fnmatch pattern for image path */
+} catq_t;
+
+
+/* parse yy/mm/dd or yyyy/mm/dd, later parts optional, to yyyymmdd */
+/* returns 0 if invalid */
+static uint32_t parse_qdate(char *s)
+{
+	int y, m = 0, d = 0, n;
+
+	n = sscanf(s, "%d/%d/%d", &y, &m, &d);
+	if (n < 1 || y < 0 || m < 0 || m > 12 || d < 0 || d > 31)
+		return 0;
+	if (y < 60)
+		y += 2000;
+	else if (y < 100)
+		y += 1900;
+	return y * 10000 + m * 100 + d;
+}
+
+
+/* returns -1 if invalid */
+static int parse_query(char *opts, catq_t *q)
+{
+	static char *tokens[] = { "name", "type", "ui", "after", "before",
+				  "tape", NULL };
+	char *val, *ep;
+	int i, rt;
+
+	memset(q, 0, sizeof(catq_t));
+	q->q_ui = -1;
+
+	while (*opts) {
+		i = getsubopt(&opts, tokens, &val);
+		if (i < 0 || !val || !*val) {
+			fprintf(stderr, "invalid query %s\n", val ? val : "");
+			return -1;
+		}
+		switch (i) {
+		    case 0:
+			q->q_name = val;
+			for (i = 0; i < 7 && val[i] && !strchr("*?[\\", val[i]);
+			     i++)
+				q->q_prefix[i] = toupper((unsigned char)val[i]);
+			break;
+
+		    case 1:
+			for (rt = 0; rectype[rt]; rt++)
+				if (strcasecmp(val, rectype[rt]) == 0)
+					break;
+			if (!rectype[rt]) {
+				fprintf(stderr, "unknown record type %s\n",
+					val);
+				return -1;
+			}
+			q->q_type = val;
+			break;
+
+		    case 2:
+			q->q_ui = strtol(val, &ep, 8);
+			if (*ep)
+				q->q_ui = un_to_ui(val);
+			if (q->q_ui < 0) {
+				fprintf(stderr, "unknown user %s\n", val);
+				return -1;
+			}
+			break;
+
+		    case 3:
+			if (!(q->q_after = parse_qdate(val))) {
+				fprintf(stderr, "invalid date %s\n", val);
+				return -1;
+			}
+			break;
+
+		    case 4:
+			if (!(q->q_before = parse_qdate(val))) {
+				fprintf(stderr, "invalid date %s\n", val);
+				return -1;
+			}
+			break;
+
+		    case 5:
+			q->q_tape = val;
+			break;
+		}
+	}
+	return 0;
+}
+
+
+/* does record match the query? */
+static int query_match(catq_t *q, catrec_t *cr, char *path)
+{
+	/* by name: PFDUMP labels and files are both "PFDUMP" */
+	if (q->q_type && strcasecmp(rectype[cr->cr_rt], q->q_type) != 0)
+		return 0;
+	if (q->q_ui >= 0 && cr->cr_ui != q->q_ui)
+		return 0;
+	if (q->q_after && cr->cr_date < q->q_after)
+		return 0;
+	if (q->q_before && (!cr->cr_date || cr->cr_date >= q->q_before))
+		return 0;
+	if (q->q_name && fnmatch(q->q_name, cr->cr_name, FNM_CASEFOLD) != 0)
+		return 0;
+	if (q->q_tape && fnmatch(q->q_tape, path, 0) != 0)
+		return 0;
+	return 1;
+}
+
+
+/*
+ * Print records in catalog db matching query, a list of name=pattern,
+ * type=rectype, ui=ui or un, after=date, before=date and tape=pattern,
+ * all of which must hold.  after= is inclusive, before= is not.
+ * returns 0 if the catalog could be searched, else 1
+ */
+int cat_query(char *db, char *query)
+{
+	catq_t q;
+	cathdr_t *ch;
+	catimg_t *img;
+	catrec_t *rec, *cr;
+	char *str, *path, date[16], ui[7];
+	size_t lo, hi, mid, plen, nmatch = 0;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (parse_query(query, &q) < 0)
+		return 1;
+
+	if ((fd = open(db, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(db);
+		return 1;
+	}
+	map = st.st_size >= sizeof(cathdr_t) ?
+	      mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) :
+	      MAP_FAILED;
+	close(fd);
+	ch = map;
+	if (map == MAP_FAILED ||
+	    memcmp(ch->ch_magic, CAT_MAGIC, sizeof ch->ch_magic) != 0 ||
+	    ch->ch_imgsize != sizeof(catimg_t) ||
+	    ch->ch_recsize != sizeof(catrec_t) ||
+	    sizeof(cathdr_t) + ch->ch_nimg * sizeof(catimg_t) +
+	    ch->ch_nrec * sizeof(catrec_t) + ch->ch_strsize > st.st_size) {
+		fprintf(stderr, "%s: not a cdctap catalog\n", db);
+		if (map != MAP_FAILED)
+			munmap(map, st.st_size);
+		return 1;
+	}
+	img = (catimg_t *)(ch + 1);
+	rec = (catrec_t *)(img + ch->ch_nimg);
+	str = (char *)(rec + ch->ch_nrec);
+
+	/* records are sorted by name: start at the pattern's fixed prefix */
+	plen = strlen(q.q_prefix);
+	lo = 0;
+	hi = ch->ch_nrec;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strncmp(rec[mid].cr_name, q.q_prefix, plen) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	dprint(("cat_query: prefix %s starts at %lu of %lu\n", q.q_prefix,
+		(unsigned long)lo, (unsigned long)ch->ch_nrec));
+
+	for (cr = rec + lo; cr < rec + ch->ch_nrec; cr++) {
+		if (strncmp(cr->cr_name, q.q_prefix, plen) != 0)
+			break;
+		path = str + img[cr->cr_img].ci_path;
+		if (!query_match(&q, cr, path))
+			continue;
+
+		date[0] = ui[0] = '\0';
+		/* cr_date is unchecked: room for any uint32_t */
+		if (cr->cr_date)
+			snprintf(date, sizeof date, "%04u/%02u/%02u",
+				 (unsigned)(cr->cr_date / 10000),
+				 (unsigned)(cr->cr_date / 100 % 100),
+				 (unsigned)(cr->cr_date % 100));
+		if (cr->cr_ui >= 0)
+			sprintf(ui, "%06o", cr->cr_ui & 0777777);
+		printf("%-7s %-6s %7d %10s %6s %s", cr->cr_name,
+		       rectype[cr->cr_rt], cr->cr_reclen, date, ui, path);
+		if (verbose)
+			printf(" @0x%lx", (long)cr->cr_off);
+		putchar('\n');
+		nmatch++;
+	}
+
+	if (verbose)
+		printf("%lu records matched\n", (unsigned long)nmatch);
+	munmap(map, st.st_size);
+	return 0;
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Catalog of the records in a collection of tape images.
+ */
+
+#ifndef _CATDB_H
+#define _CATDB_H 1
+
+extern int cat_update(char *db, char **files, int nfile, int sidecar);
+extern int cat_query(char *db, char *query);
+
+#endif /* _CATDB_H */
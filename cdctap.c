@@ -19,23 +19,36 @@
  * Read CDC I-format tapes in SIMH tape image format.
  */
 
+#include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <alloca.h>
 #include "ansi.h"
+#include "blkstore.h"
+#include "catdb.h"
+#include "cstore.h"
 #include "dcode.h"
+#include "fsect.h"
 #include "ifmt.h"
+#include "manifest.h"
 #include "outfile.h"
 #include "opl.h"
 #include "pfdump.h"
 #include "rectype.h"
+#include "replica.h"
 #include "simtap.h"
+#include "tapidx.h"
 #include "cdctap.h"
 
 
@@ -44,6 +57,53 @@ int verbose = 0;
 
 static int ascii = 0;
 static int lfmt = 0;
+static int nested = 0;
+static int use_index = 1;
+static int sections = 0;		/* -F given */
+static int resume = 0;
+
+/* -s: only tapemarks, labels and records starting in [slice_lo, slice_hi) */
+static int slicing = 0;
+static int slice_blocks = 0;		/* range was given in blocks */
+static off_t slice_lo = 0, slice_hi = -1;
+static long shard_i = 0, shard_n = 1;
+
+
+/* block acceptable when resynchronizing: I-format block or tape label */
+int plausible_block(char *buf, int nbytes)
+{
+	char lbuf[80];
+
+	return is_label(buf, nbytes, lbuf) || cdc_valid_iblock(buf, nbytes);
+}
+
+
+/* is this index entry in the slice? */
+static int in_slice(idxent_t *ie)
+{
+	return !slicing || ie->ie_off >= slice_lo && ie->ie_off < slice_hi;
+}
+
+
+/* position tap at the first tapemark, label or record starting in slice */
+/* returns -1 if there is none */
+static int slice_seek(TAPE *tap)
+{
+	off_t off;
+	long prev;
+
+	if (tap_sync(tap, slice_lo, plausible_block, &prev) < 0)
+		return -1;
+
+	/* in a record begun before the slice: skip past its last block */
+	while (prev > 0 && !cdc_block_eor(prev)) {
+		off = tap_tell(tap);
+		prev = tap_skipblock(tap, NULL, 0);
+		if (prev == 0)
+			return tap_seek(tap, off);
+	}
+	return prev < 0 ? -1 : 0;
+}
 
 
 /*
@@ -114,6 +174,12 @@ int do_dopt(TAPE *tap, int argc, char **argv)
 					rectype[rt], name);
 			(void) cdc_skipr(&cd);
 		}
+		if (cd.cd_limit) {
+			(void) cdc_skipr(&cd);
+			fprintf(stderr, "%s/%s: remainder skipped\n",
+				rectype[rt], name);
+			ec = 2;
+		}
 		cdc_ctx_fini(&cd);
 	}
 
@@ -126,6 +192,52 @@ int do_dopt(TAPE *tap, int argc, char **argv)
 }
 
 
+/*
+ * -b: show tape block offsets and sizes, without reading block data.
+ */
+
+int do_bopt(TAPE *tap)
+{
+	TAPBLK *tab, *bp;
+	ssize_t n;
+	unsigned long nblk = 0, nmark = 0;
+	int ec = 0;
+
+	n = tap_blocktab(tap, &tab);
+	if (n < 0)
+		return 2;
+
+	for (bp = tab; bp < tab + n; bp++) {
+		printf("%10lx ", (long)bp->bt_off);
+		switch (bp->bt_kind) {
+		    case BT_DATA:
+			printf("%5u\n", bp->bt_nbytes);
+			nblk++;
+			break;
+
+		    case BT_MARK:
+			printf(" --mark--\n");
+			nmark++;
+			break;
+
+		    case BT_EOM:
+			printf(" --end--\n");
+			break;
+
+		    case BT_ERR:
+			printf(" --error--\n");
+			ec = 2;
+			break;
+		}
+	}
+	if (verbose)
+		printf("%lu blocks, %lu tapemarks\n", nblk, nmark);
+
+	free(tab);
+	return ec;
+}
+
+
 /*
  * -r: show raw tape block structure.
  */
@@ -180,6 +292,112 @@ int do_ropt(TAPE *tap)
  * -t: catalog the tape.
  */
 
+/* print one catalog entry; *colp is column in compact format */
+/* returns 0 if omitted */
+static int print_entry(idxent_t *ie, int *colp, int *ulibp)
+{
+	char *lbuf = ie->ie_text;
+	char date[11], *dp = date;
+	char hex[HASH_HEXLEN];
+	rectype_t rt = ie->ie_rt;
+	int n;
+
+	switch (ie->ie_kind) {
+	    case IE_MARK:
+		printf("  --mark--\n");
+		return 1;
+
+	    case IE_LABEL:
+		switch (lbuf[0]) {
+		    case 'V':
+			print_lfield("Catalog of ", lbuf+4, lbuf+9);
+			if (print_lfield(" (", lbuf+37, lbuf+50))
+				putchar(')');
+			break;
+
+		    case 'H':
+			print_lfield("\nCatalog of ", lbuf+4, lbuf+20);
+			print_jdate(" ", lbuf+41);
+			putchar('\n');
+			break;
+
+		    default:
+			/* ignore other labels */
+			break;
+		}
+		return 1;
+	}
+
+	/* ULIB: omit contents unless -l */
+	if (!lfmt) {
+		/* skip until OPLD */
+		if (*ulibp) {
+			if (rt == RT_OPLD)
+				*ulibp = 0;
+			return 0;
+		}
+
+		if (rt == RT_ULIB)
+			*ulibp = 1;
+	}
+
+	/* print record info */
+	if (verbose) {
+		/* omit trailing space/period, leading space */
+		memcpy(date, ie->ie_date, sizeof date);
+		for (n = 9; n > 7; n--)
+			if (dp[n] == ' ' || dp[n] == '.')
+				dp[n] = '\0';
+		if (dp[0] == ' ')
+			dp++;
+
+		printf("%-7s %-6s", ie->ie_name, rectype[rt]);
+		if (rt > RT_EOF)
+			printf(" %7d %8s", ie->ie_reclen, dp);
+		if (rt > RT_EOF && cdc_hashing)
+			printf(" %s", hash_hex(&ie->ie_digest, cdc_hashing,
+					       hex));
+		printf(" %.*s\n", verbose < 2 ? 48 : EXTRA_LEN, ie->ie_text);
+	} else {
+		switch (rt) {
+		    case RT_EOF:
+			*colp = 4;
+			/* fall through */
+		    case RT_EMPTY:
+			printf("%8s%6s", rectype[rt], "");
+			break;
+
+		    default:
+			printf("%6s/%-7s", rectype[rt], ie->ie_name);
+		}
+		if (++*colp > 4) {
+			putchar('\n');
+			*colp = 0;
+		} else
+			putchar(' ');
+	}
+	return 1;
+}
+
+
+/* print catalog from an index */
+/* returns -1 if out of memory */
+static int print_index(tapidx_t *ix)
+{
+	int col = 0, in_ulib = 0;
+	char *keep = NULL;
+	size_t n;
+
+	if (sections && !(keep = fs_keep(ix)))
+		return -1;
+	for (n = 0; n < ix->ix_nent; n++)
+		if (in_slice(&ix->ix_ent[n]) && (!keep || keep[n]))
+			(void) print_entry(&ix->ix_ent[n], &col, &in_ulib);
+	free(keep);
+	return 0;
+}
+
+
 int do_topt(TAPE *tap)
 {
 	ssize_t nbytes;
@@ -187,12 +405,36 @@ int do_topt(TAPE *tap)
 	int ec = 0;
 	cdc_ctx_t cd;
 	int nchar, ui, in_ulib = 0;
-	char name[8], date[11], extra[EXTRA_LEN+1];
-	char lbuf[81];
-	rectype_t rt;
-	int i, reclen;
+	int i, v, s, fss = 0;
+	TAPE *mt, *nt;
+	char *ibuf;
+	size_t ilen;
+	tapidx_t *ix = NULL;
+	idxent_t ie;
 
 	i = 0;
+
+	/* replay a current index, else build one while scanning */
+	if (use_index && !nested) {
+		if ((ix = idx_load(tap)) != NULL) {
+			ec = print_index(ix);
+			idx_free(ix);
+			if (ec == 0)
+				return 0;
+			ix = NULL;
+			ec = 0;
+		}
+		if (!slicing && !sections)
+			ix = idx_new(tap);
+	}
+	if (slicing && sections) {
+		fprintf(stderr, "%s: -F with -s needs a current index\n",
+			tap->tp_path);
+		return 1;
+	}
+	if (slicing && slice_seek(tap) < 0)
+		return 0;
+
 	while (1) {
 		nbytes = tap_readblock(tap, &tbuf);
 		if (nbytes < 0) {
@@ -200,29 +442,34 @@ int do_topt(TAPE *tap)
 				ec = 2;
 			break;
 		}
+		if (slicing && tap->tp_boff >= slice_hi)
+			break;
+
+		memset(&ie, 0, sizeof ie);
+		ie.ie_off = tap->tp_boff;
+		ie.ie_end = tap_tell(tap);
+		ie.ie_nblocks = 1;
 		if (nbytes == 0) {
-			printf("  --mark--\n");
+			ie.ie_kind = IE_MARK;
+			idx_add(ix, &ie);
+			if (!sections || fs_scan(tap, &fss, IE_MARK, NULL))
+				(void) print_entry(&ie, &i, &in_ulib);
 			continue;
 		}
 
-		if (is_label(tbuf, nbytes, lbuf)) {
-			switch (lbuf[0]) {
-			    case 'V':
-				print_lfield("Catalog of ", lbuf+4, lbuf+9);
-				if (print_lfield(" (", lbuf+37, lbuf+50))
-					putchar(')');
-				break;
-
-			    case 'H':
-				print_lfield("\nCatalog of ", lbuf+4, lbuf+20);
-				print_jdate(" ", lbuf+41);
-				putchar('\n');
-				break;
-
-			    default:
-				/* ignore other labels */
-				break;
+		if (is_label(tbuf, nbytes, ie.ie_text)) {
+			/* -F: pass over unselected section unread */
+			if (sections &&
+			    (v = fs_scan(tap, &fss, IE_LABEL, ie.ie_text)) <= 0) {
+				if (v < 0) {
+					ec = 2;
+					break;
+				}
+				continue;
 			}
+			ie.ie_kind = IE_LABEL;
+			idx_add(ix, &ie);
+			(void) print_entry(&ie, &i, &in_ulib);
 			continue;
 		}
 
@@ -232,59 +479,68 @@ int do_topt(TAPE *tap)
 			ec = 2;
 			break;
 		}
-		rt = id_record(cbuf, nchar, name, date, extra, &ui);
-		reclen = cdc_skipr(&cd);
-
-		/* ULIB: omit contents unless -l */
-		if (!lfmt) {
-			/* skip until OPLD */
-			if (in_ulib) {
-				if (rt == RT_OPLD)
-					in_ulib = 0;
-				cdc_ctx_fini(&cd);
-				continue;
-			}
-
-			if (rt == RT_ULIB)
-				in_ulib = 1;
+		if (sections && !fs_scan(tap, &fss, IE_REC, NULL)) {
+			(void) cdc_skipr(&cd);
+			cdc_ctx_fini(&cd);
+			continue;
 		}
+		ie.ie_kind = IE_REC;
+		ie.ie_rt = id_record(cbuf, nchar, ie.ie_name, ie.ie_date,
+				     ie.ie_text, &ui);
+		ie.ie_ui = ui;
+
+		/* -N: unpack dumped file to memory instead of skipping it */
+		mt = NULL;
+		if (nested && ie.ie_rt == RT_PFDUMP)
+			(void) extract_pfdump(&cd, ie.ie_name, &mt);
+		else if (nested && ie.ie_rt == RT_DUMPPF)
+			(void) extract_dumppf(&cd, ie.ie_name, &mt);
+		ie.ie_reclen = cdc_skipr(&cd);
+		(void) cdc_digest(&cd, &ie.ie_digest);
+		ie.ie_nblocks = MAX(cd.cd_nblocks, 1);
+		ie.ie_end = tap_tell(tap);
+		cdc_ctx_fini(&cd);
 
-		/* print record info */
-		if (verbose) {
-			char *dp = date;
-
-			/* omit trailing space/period, leading space */
-			for (nchar = 9; nchar > 7; nchar--)
-				if (dp[nchar] == ' ' || dp[nchar] == '.')
-					dp[nchar] = '\0';
-			if (dp[0] == ' ')
-				dp++;
-
-			printf("%-7s %-6s", name, rectype[rt]);
-			if (rt > RT_EOF)
-				printf(" %7d %8s", reclen, dp);
-			if (verbose < 2)
-				extra[48] = '\0';
-			printf(" %s\n", extra);
-		} else {
-			switch (rt) {
-			    case RT_EOF:
-				i = 4;
-				/* fall through */
-			    case RT_EMPTY:
-				printf("%8s%6s", rectype[rt], "");
-				break;
+		idx_add(ix, &ie);
+		if (!print_entry(&ie, &i, &in_ulib)) {
+			if (mt)
+				tap_close(mt);
+			continue;
+		}
 
-			    default:
-				printf("%6s/%-7s", rectype[rt], name);
+		/* -N: catalog the dumped file, one record per line */
+		if (mt) {
+			ibuf = tap_membuf(mt, &ilen);
+			tap_close(mt);
+			nt = ibuf ? tap_memopen(ibuf, ilen, ie.ie_name) : NULL;
+			if (nt) {
+				if (i) {
+					putchar('\n');
+					i = 0;
+				}
+				printf("  --contents of %s--\n", ie.ie_name);
+				/* dumped files have no sections */
+				v = verbose;
+				s = sections;
+				if (!verbose)
+					verbose = 1;
+				sections = 0;
+				ec |= do_topt(nt);
+				verbose = v;
+				sections = s;
+				printf("  --end of %s--\n", ie.ie_name);
+				tap_close(nt);
 			}
-			if (++i > 4) {
-				putchar('\n');
-				i = 0;
-			} else
-				putchar(' ');
+			free(ibuf);
 		}
-		cdc_ctx_fini(&cd);
+	}
+
+	if (sections)
+		fs_done(fss);
+	if (ix) {
+		if (!ec)
+			(void) idx_save(ix);
+		idx_free(ix);
 	}
 	return ec;
 }
@@ -297,7 +553,7 @@ int do_topt(TAPE *tap)
 char *extract_text(cdc_ctx_t *cd, char *name, struct tm *tm)
 {
 	FILE *of;
-	char fname[16];
+	char fname[40];
 	int i, oc, eol = 0, esc = 0;
 	char c, *cp;
 
@@ -353,25 +609,77 @@ char *extract_text(cdc_ctx_t *cd, char *name, struct tm *tm)
 }
 
 
-int do_xopt(TAPE *tap, int argc, char **argv)
+/* extract PFDUMP or DUMPPF record; with -O, write the image to stdout */
+char *extract_dump(cdc_ctx_t *cd, rectype_t rt, char *name)
+{
+	TAPE *mt = NULL;
+	char *err, *buf;
+	size_t len;
+
+	if (!sout)
+		return rt == RT_PFDUMP ? extract_pfdump(cd, name, NULL) :
+					 extract_dumppf(cd, name, NULL);
+
+	err = rt == RT_PFDUMP ? extract_pfdump(cd, name, &mt) :
+				extract_dumppf(cd, name, &mt);
+	if (mt) {
+		buf = tap_membuf(mt, &len);
+		tap_close(mt);
+		if (buf && fwrite(buf, 1, len, stdout) != len)
+			err = "write error";
+		free(buf);
+	}
+	return err;
+}
+
+
+/* does an index entry match any of the names to extract? */
+static int index_match(idxent_t *ie, int argc, char **argv)
+{
+	char name[8];
+	int i;
+
+	if (ie->ie_kind != IE_REC)
+		return 0;
+	for (i = 0; i < argc; i++) {
+		/* name_match scribbles on name */
+		strcpy(name, ie->ie_name[0] ? ie->ie_name : "noname");
+		if (name_match(argv[i], name, ie->ie_ui))
+			return 1;
+	}
+	return 0;
+}
+
+
+/* ix, if not NULL, is a current index of tap */
+int do_xopt(TAPE *tap, tapidx_t *ix, int argc, char **argv)
 {
 	int ec = 0;
 	ssize_t nbytes;
 	cdc_ctx_t cd;
 	char *tbuf, *cbuf;
 	int i, nchar, ui;
+	size_t n = 0;
 	char *found;
 	struct stat st;
 	struct tm tm;
+	int fss = 0;
+	char *keep = NULL;
+	off_t roff;
+	long ord = 0, rord;
+	size_t m = 0;
 	rectype_t rt;
 	char name[8], date[11], extra[EXTRA_LEN+1];
 	char lbuf[81];
-	char *fn, *err;
+	char *fn = NULL, *err;
+	char hex[HASH_HEXLEN], *rhash;
+	digest_t dg;
 
-	/* get mtime of source tape */
+	/* get mtime of source tape, unless it's a pipe */
 	memset(&tm, 0, sizeof tm);
 	tm.tm_hour = 12;
-	if (stat(tap->tp_path, &st) == 0)
+	if (strcmp(tap->tp_path, "-") != 0 &&
+	    stat(tap->tp_path, &st) == 0 && S_ISREG(st.st_mode))
 		(void) localtime_r(&st.st_mtime, &tm);
 
 	found = alloca(argc);
@@ -381,19 +689,74 @@ int do_xopt(TAPE *tap, int argc, char **argv)
 	}
 	memset(found, 0, argc);
 
+	/* with a current index, seek straight to matching records */
+	if (ix && (tap_seek(tap, tap_tell(tap)) < 0 ||
+		   sections && !(keep = fs_keep(ix))))
+		ix = NULL;
+	if (slicing && sections && !ix) {
+		fprintf(stderr, "%s: -F with -s needs a current index\n",
+			tap->tp_path);
+		return 1;
+	}
+	if (slicing && !ix && slice_seek(tap) < 0)
+		return 0;
+
+	/* -k: records before the manifest's last are done or don't match */
+	/* (-F must read from the start to know which section it's in) */
+	if (resume && !ix && !sections && (roff = mf_resume(&rord)) > tap_tell(tap) &&
+	    tap_seek(tap, roff) == 0)
+		ord = rord - 1;
+
 	while (1) {
+		if (ix) {
+			while (n < ix->ix_nent &&
+			       (!in_slice(&ix->ix_ent[n]) || keep && !keep[n] ||
+				!index_match(&ix->ix_ent[n], argc, argv) ||
+				mf_ok(ix->ix_ent[n].ie_off)))
+				n++;
+			if (n == ix->ix_nent)
+				break;
+			for (; m <= n; m++)
+				if (ix->ix_ent[m].ie_kind == IE_REC)
+					ord++;
+			dprint(("do_xopt: index entry %lu at 0x%lx\n",
+				(unsigned long)n, (long)ix->ix_ent[n].ie_off));
+			if (tap_seek(tap, ix->ix_ent[n++].ie_off) < 0) {
+				ec = 2;
+				break;
+			}
+		}
+
 		nbytes = tap_readblock(tap, &tbuf);
 		if (nbytes < 0) {
 			if (nbytes == -2)
 				ec = 2;
 			break;
 		}
+		if (slicing && tap->tp_boff >= slice_hi)
+			break;
 
-		/* skip tape marks and tape labels */
-		if (nbytes == 0)
+		/* skip tape marks and tape labels, and unselected sections */
+		if (nbytes == 0) {
+			if (sections && !ix)
+				(void) fs_scan(tap, &fss, IE_MARK, NULL);
 			continue;
-		if (is_label(tbuf, nbytes, lbuf))
+		}
+		if (is_label(tbuf, nbytes, lbuf)) {
+			if (sections && !ix &&
+			    fs_scan(tap, &fss, IE_LABEL, lbuf) < 0) {
+				ec = 2;
+				break;
+			}
 			continue;
+		}
+
+		/* slices name files by record offset, so they never collide */
+		roff = tap->tp_boff;
+		if (slicing)
+			sprintf(out_tag, "%lx", (long)roff);
+		if (!ix)
+			ord++;
 
 		/* unpack to 6-bit characters and identify */
 		nchar = cdc_ctx_init(&cd, tap, tbuf, nbytes, &cbuf);
@@ -401,6 +764,14 @@ int do_xopt(TAPE *tap, int argc, char **argv)
 			ec = 2;
 			break;
 		}
+
+		/* -k: already extracted; -F: not in a selected section */
+		if (mf_ok(roff) ||
+		    sections && !ix && !fs_scan(tap, &fss, IE_REC, NULL)) {
+			(void) cdc_skipr(&cd);
+			cdc_ctx_fini(&cd);
+			continue;
+		}
 		rt = id_record(cbuf, nchar, name, date, extra, &ui);
 		if (!name[0])
 			strcpy(name, "noname");
@@ -417,6 +788,7 @@ int do_xopt(TAPE *tap, int argc, char **argv)
 		}
 		found[i] = 1;
 		err = NULL;
+		mf_record(roff, ord, name, ui);
 
 		dprint(("do_xopt: nbytes %ld nchar %d\n", nbytes, nchar));
 		switch (rt) {
@@ -439,11 +811,8 @@ int do_xopt(TAPE *tap, int argc, char **argv)
 			break;
 
 		    case RT_DUMPPF:
-			err = extract_dumppf(&cd, fn);
-			break;
-
 		    case RT_PFDUMP:
-			err = extract_pfdump(&cd, fn);
+			err = extract_dump(&cd, rt, fn);
 			break;
 
 		    default:
@@ -452,6 +821,12 @@ int do_xopt(TAPE *tap, int argc, char **argv)
 			(void) cdc_skipr(&cd);
 		}
 
+		/* abandoned record: skip rest of it */
+		if (cd.cd_limit) {
+			(void) cdc_skipr(&cd);
+			err = "remainder skipped";
+		}
+
 		if (err) {
 			ec = 2;
 			if (err[0])
@@ -459,11 +834,29 @@ int do_xopt(TAPE *tap, int argc, char **argv)
 					name, err);
 		}
 
+		/* -H: record hash for the manifest, read to EOR for it */
+		rhash = NULL;
+		if (cdc_hashing) {
+			(void) cdc_skipr(&cd);
+			if (cdc_digest(&cd, &dg) == 0)
+				rhash = hash_hex(&dg, cdc_hashing, hex);
+		}
+
 		cdc_ctx_fini(&cd);
+		cs_done();
+		if (err)
+			mf_fail();
+		else
+			mf_done(rhash);
 	}
 
-	for (i = 0; i < argc; i++)
-		if (!found[i]) {
+	free(keep);
+	if (sections && !ix)
+		fs_done(fss);
+
+	/* a slice's names are likely in some other slice */
+	for (i = 0; i < argc && !slicing; i++)
+		if (!found[i] && !mf_found(argv[i])) {
 			fprintf(stderr, "%s not found\n", argv[i]);
 			ec = 2;
 		}
@@ -471,6 +864,547 @@ int do_xopt(TAPE *tap, int argc, char **argv)
 }
 
 
+/*
+ * -M: merge replica images of the same tape into a best-of image.
+ */
+
+int do_mopt(char **files, int nfile, char *oname)
+{
+	TAPE **taps, *ot;
+	char *fname;
+	int i, ec = 1;
+
+	fname = alloca(strlen(oname) + 16);
+	taps = calloc(nfile, sizeof(TAPE *));
+	if (!fname || !taps) {
+		fprintf(stderr, "do_mopt: out of memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < nfile; i++)
+		if (!(taps[i] = tap_open(files[i], NULL))) {
+			perror(files[i]);
+			goto done;
+		}
+
+	ot = tap_open(oname, fname);
+	if (ot) {
+		ec = merge_replicas(taps, nfile, ot);
+		tap_close(ot);
+	}
+
+    done:
+	for (i = 0; i < nfile && taps[i]; i++)
+		tap_close(taps[i]);
+	free(taps);
+	return ec;
+}
+
+
+/*
+ * -E: compare the records of two images.
+ *
+ * Each image is read once, hashing its records instead of decoding
+ * them, or not at all if its index is current and has their hashes.
+ * Records are paired by name, type and user index, first with a record
+ * of the same kind and contents, then in tape order with what's left,
+ * so one record dropped among many of the same name doesn't turn all
+ * that follow into changes.
+ */
+
+static int cmp_kind(idxent_t *a, idxent_t *b)
+{
+	int c;
+
+	if ((c = strncmp(a->ie_name, b->ie_name, sizeof a->ie_name)) != 0)
+		return c;
+	if (a->ie_rt != b->ie_rt)
+		return a->ie_rt - b->ie_rt;
+	return a->ie_ui < b->ie_ui ? -1 : a->ie_ui > b->ie_ui;
+}
+
+
+static int cmp_data(idxent_t *a, idxent_t *b)
+{
+	int c;
+
+	if ((c = cmp_kind(a, b)) != 0)
+		return c;
+	if (a->ie_reclen != b->ie_reclen)
+		return a->ie_reclen < b->ie_reclen ? -1 : 1;
+	if (a->ie_digest.hd_fast != b->ie_digest.hd_fast)
+		return a->ie_digest.hd_fast < b->ie_digest.hd_fast ? -1 : 1;
+	if (!(cdc_hashing & HASH_SHA256))
+		return 0;
+	return memcmp(a->ie_digest.hd_sha, b->ie_digest.hd_sha,
+		      sizeof a->ie_digest.hd_sha);
+}
+
+
+/* by kind, then tape order */
+static int cmp_diff(const void *a, const void *b)
+{
+	idxent_t *x = *(idxent_t **)a, *y = *(idxent_t **)b;
+	int c;
+
+	if ((c = cmp_kind(x, y)) != 0)
+		return c;
+	return x < y ? -1 : x > y;
+}
+
+
+/* by kind and contents, then tape order */
+static int cmp_same(const void *a, const void *b)
+{
+	idxent_t *x = *(idxent_t **)a, *y = *(idxent_t **)b;
+	int c;
+
+	if ((c = cmp_data(x, y)) != 0)
+		return c;
+	return x < y ? -1 : x > y;
+}
+
+
+/* pair sorted rec[0] and rec[1] by cmp, then drop the paired ones */
+static void diff_pair(tapidx_t **ix, idxent_t ***rec, size_t *nrec,
+		      idxent_t ***mate, int (*cmp)(idxent_t *, idxent_t *))
+{
+	size_t i, j, n;
+	int c, s;
+
+	i = j = 0;
+	while (i < nrec[0] && j < nrec[1]) {
+		c = cmp(rec[0][i], rec[1][j]);
+		if (c < 0)
+			i++;
+		else if (c > 0)
+			j++;
+		else {
+			mate[0][rec[0][i] - ix[0]->ix_ent] = rec[1][j];
+			mate[1][rec[1][j] - ix[1]->ix_ent] = rec[0][i];
+			i++;
+			j++;
+		}
+	}
+
+	for (s = 0; s < 2; s++) {
+		for (i = n = 0; i < nrec[s]; i++)
+			if (!mate[s][rec[s][i] - ix[s]->ix_ent])
+				rec[s][n++] = rec[s][i];
+		nrec[s] = n;
+	}
+}
+
+
+/* returns index of file's records, NULL on error */
+static tapidx_t *diff_index(char *file, int *ecp)
+{
+	tapidx_t *ix;
+	TAPE *tap;
+
+	if (!(tap = tap_open(file, NULL))) {
+		perror(file);
+		return NULL;
+	}
+	if (use_index && (ix = idx_load(tap)) != NULL) {
+		tap_close(tap);
+		return ix;
+	}
+
+	/* an image that can't be indexed is scanned into memory */
+	if (!(ix = idx_new(tap)) && (ix = calloc(1, sizeof(tapidx_t))))
+		ix->ix_digests = cdc_hashing;
+	if (!ix || ix->ix_bad) {
+		fprintf(stderr, "%s: out of memory\n", file);
+		goto fail;
+	}
+	if (idx_scan(ix, tap) < 0) {
+		fprintf(stderr, "%s: comparing only records before 0x%lx\n",
+			file, (long)tap->tp_boff);
+		*ecp = 2;
+	} else if (use_index && ix->ix_path)
+		(void) idx_save(ix);
+	if (ix->ix_bad) {
+		fprintf(stderr, "%s: out of memory\n", file);
+		goto fail;
+	}
+	tap_close(tap);
+	return ix;
+
+    fail:
+	idx_free(ix);
+	tap_close(tap);
+	return NULL;
+}
+
+
+static void diff_print(int c, idxent_t *ie, idxent_t *was)
+{
+	char date[11], *dp = date;
+	char ui[8], hex[HASH_HEXLEN];
+	int n;
+
+	memcpy(date, ie->ie_date, sizeof date);
+	for (n = 9; n > 7; n--)
+		if (dp[n] == ' ' || dp[n] == '.')
+			dp[n] = '\0';
+	if (dp[0] == ' ')
+		dp++;
+	ui[0] = '\0';
+	if (ie->ie_ui >= 0)
+		sprintf(ui, "%06o", ie->ie_ui & 0777777);
+
+	printf("%c %-7s %-6s %7d %8s %6s", c, ie->ie_name, rectype[ie->ie_rt],
+	       ie->ie_reclen, dp, ui);
+	if (verbose)
+		printf(" %s", hash_hex(&ie->ie_digest, cdc_hashing, hex));
+	if (was && was->ie_reclen != ie->ie_reclen)
+		printf(" (was %d)", was->ie_reclen);
+	putchar('\n');
+}
+
+
+int do_eopt(char **files)
+{
+	tapidx_t *ix[2];
+	idxent_t **rec[2], **mate[2], *e, *o;
+	size_t nrec[2], nsame = 0, nchg = 0, nadd = 0, ndel = 0;
+	size_t i, j, k;
+	int s, ec = 0;
+
+	ix[0] = diff_index(files[0], &ec);
+	ix[1] = ix[0] ? diff_index(files[1], &ec) : NULL;
+	if (!ix[1]) {
+		idx_free(ix[0]);
+		return 1;
+	}
+
+	/* pair identical records, then the rest by kind */
+	for (s = 0; s < 2; s++) {
+		rec[s] = malloc(ix[s]->ix_nent * sizeof(idxent_t *) + 1);
+		mate[s] = calloc(ix[s]->ix_nent + 1, sizeof(idxent_t *));
+		if (!rec[s] || !mate[s]) {
+			fprintf(stderr, "do_eopt: out of memory\n");
+			exit(1);
+		}
+		nrec[s] = 0;
+		for (i = 0; i < ix[s]->ix_nent; i++)
+			if (ix[s]->ix_ent[i].ie_kind == IE_REC)
+				rec[s][nrec[s]++] = &ix[s]->ix_ent[i];
+		qsort(rec[s], nrec[s], sizeof(idxent_t *), cmp_same);
+	}
+	diff_pair(ix, rec, nrec, mate, cmp_data);
+	for (s = 0; s < 2; s++)
+		qsort(rec[s], nrec[s], sizeof(idxent_t *), cmp_diff);
+	diff_pair(ix, rec, nrec, mate, cmp_kind);
+
+	/* report in the new image's order, removals where they were */
+	k = 0;
+	for (j = 0; j < ix[1]->ix_nent; j++) {
+		e = &ix[1]->ix_ent[j];
+		if (e->ie_kind != IE_REC)
+			continue;
+		if (!(o = mate[1][j])) {
+			diff_print('+', e, NULL);
+			nadd++;
+			continue;
+		}
+		for (; k < (size_t)(o - ix[0]->ix_ent); k++)
+			if (ix[0]->ix_ent[k].ie_kind == IE_REC && !mate[0][k]) {
+				diff_print('-', &ix[0]->ix_ent[k], NULL);
+				ndel++;
+			}
+		if (cmp_data(o, e) != 0) {
+			diff_print('!', e, o);
+			nchg++;
+		} else {
+			if (verbose)
+				diff_print('=', e, NULL);
+			nsame++;
+		}
+	}
+	for (; k < ix[0]->ix_nent; k++)
+		if (ix[0]->ix_ent[k].ie_kind == IE_REC && !mate[0][k]) {
+			diff_print('-', &ix[0]->ix_ent[k], NULL);
+			ndel++;
+		}
+
+	printf("%lu unchanged, %lu changed, %lu added, %lu removed\n",
+	       (unsigned long)nsame, (unsigned long)nchg,
+	       (unsigned long)nadd, (unsigned long)ndel);
+	for (s = 0; s < 2; s++) {
+		free(rec[s]);
+		free(mate[s]);
+		idx_free(ix[s]);
+	}
+	if (!ec && (nchg || nadd || ndel))
+		ec = 1;
+	return ec;
+}
+
+
+/*
+ * -S: serve catalog, extract and stream requests on a Unix socket.
+ *
+ * Images are mapped and indexed once at startup.  Each connection is
+ * served by a child process, which inherits the mappings and indexes and
+ * may use the extractors' global state freely.  At most SERVE_MAXCHILD
+ * run at once; further connections wait in the listen queue.
+ */
+
+#define SERVE_MAXCHILD	16
+
+typedef struct {
+	char		*sv_name;
+	TAPE		*sv_tap;
+	tapidx_t	*sv_ix;
+} served_t;
+
+static served_t *served;
+static int nserved;
+static char *sock_path;
+
+
+static void serve_stop(int sig)
+{
+	(void) unlink(sock_path);
+	_exit(0);
+}
+
+
+/* returns -1 if error */
+static int write_all(int fd, char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+/* read one request line "op image [name]" from fd and answer it */
+/* reply is "OK" then data until EOF, or "ERR why"; returns exit code */
+static int serve_request(int fd)
+{
+	char req[1024], buf[16384], *op, *image, *name, *err = NULL;
+	served_t *sv = NULL;
+	idxent_t *ie;
+	FILE *tf = NULL;
+	size_t len = 0, n;
+	ssize_t nr;
+	int i, ec = 0;
+
+	while (len < sizeof req - 1 && read(fd, req+len, 1) == 1 &&
+	       req[len] != '\n')
+		len++;
+	req[len] = '\0';
+	op = strtok(req, " \t\r");
+	image = strtok(NULL, " \t\r");
+	name = strtok(NULL, " \t\r");
+
+	for (i = 0; image && i < nserved; i++)
+		if (strcmp(image, served[i].sv_name) == 0)
+			sv = &served[i];
+
+	if (!op)
+		err = "empty request";
+	else if (strcmp(op, "catalog") != 0 && strcmp(op, "extract") != 0 &&
+		 strcmp(op, "stream") != 0)
+		err = "unknown request";
+	else if (!sv)
+		err = "unknown image";
+	else if (op[0] == 'c' ? name != NULL : name == NULL)
+		err = "usage: catalog image | extract image name | "
+		      "stream image name";
+	else if (name) {
+		for (n = 0; n < sv->sv_ix->ix_nent; n++)
+			if (index_match(&sv->sv_ix->ix_ent[n], 1, &name))
+				break;
+		if (n == sv->sv_ix->ix_nent)
+			err = "not found";
+		for ( ; !err && op[0] == 's' && n < sv->sv_ix->ix_nent; n++) {
+			ie = &sv->sv_ix->ix_ent[n];
+			if (index_match(ie, 1, &name) &&
+			    ie->ie_end > sv->sv_tap->tp_mapsize)
+				err = "index doesn't match image";
+		}
+	}
+
+	/* extract to a scratch file first, so the reply can say if it failed */
+	if (!err && op[0] == 'e') {
+		if (!(tf = tmpfile()) || dup2(fileno(tf), 1) < 0) {
+			perror("serve_request: tmpfile");
+			err = "can't buffer extraction";
+		} else {
+			sout = 1;
+			ec = do_xopt(sv->sv_tap, sv->sv_ix, 1, &name);
+			if (fflush(stdout) != 0 || ec)
+				err = "extraction failed";
+		}
+	}
+
+	if (verbose)
+		fprintf(stderr, "%s %s %s: %s\n", op ? op : "", image ? image : "",
+			name ? name : "", err ? err : "OK");
+	if (err) {
+		dprintf(fd, "ERR %s\n", err);
+		close(fd);
+		return ec ? ec : 1;
+	}
+
+	if (dup2(fd, 1) < 0) {
+		perror("dup2");
+		return 1;
+	}
+	close(fd);
+	fputs("OK\n", stdout);
+
+	switch (op[0]) {
+	    case 'c':
+		(void) print_index(sv->sv_ix);
+		break;
+
+	    case 'e':
+		fflush(stdout);
+		if (lseek(fileno(tf), 0, SEEK_SET) < 0)
+			ec = 2;
+		while (!ec && (nr = read(fileno(tf), buf, sizeof buf)) != 0)
+			if (nr < 0 || write_all(1, buf, nr) < 0)
+				ec = 2;
+		fclose(tf);
+		break;
+
+	    case 's':
+		/* matching records' SIMH blocks, straight from the mapping */
+		fflush(stdout);
+		for (n = 0; n < sv->sv_ix->ix_nent; n++) {
+			ie = &sv->sv_ix->ix_ent[n];
+			if (!index_match(ie, 1, &name))
+				continue;
+			if (write_all(1, sv->sv_tap->tp_map + ie->ie_off,
+				      ie->ie_end - ie->ie_off) < 0) {
+				ec = 2;
+				break;
+			}
+		}
+		break;
+	}
+	if (fflush(stdout) != 0)
+		ec = 2;
+	return ec;
+}
+
+
+int do_sopt(char *sock, char **files, int nfile)
+{
+	struct sockaddr_un sa;
+	struct stat st;
+	served_t *sv;
+	int i, sfd, cfd, nchild = 0;
+	pid_t pid;
+
+	memset(&sa, 0, sizeof sa);
+	if (strlen(sock) >= sizeof sa.sun_path) {
+		fprintf(stderr, "%s: socket path too long\n", sock);
+		return 1;
+	}
+	served = calloc(nfile, sizeof(served_t));
+	if (!served) {
+		fprintf(stderr, "do_sopt: out of memory\n");
+		return 1;
+	}
+
+	/* a read-ahead thread wouldn't survive fork */
+	tap_qdepth = 0;
+
+	/* map and index every image now, once */
+	for (i = 0; i < nfile; i++) {
+		sv = &served[nserved];
+		sv->sv_name = files[i];
+		if (!(sv->sv_tap = tap_open(files[i], NULL))) {
+			perror(files[i]);
+			return 1;
+		}
+		nserved++;
+		if (!sv->sv_tap->tp_map) {
+			fprintf(stderr, "%s: can only serve mapped image files\n",
+				files[i]);
+			return 1;
+		}
+		if (use_index && (sv->sv_ix = idx_load(sv->sv_tap)) != NULL)
+			continue;
+		if (!(sv->sv_ix = idx_new(sv->sv_tap)) ||
+		    idx_scan(sv->sv_ix, sv->sv_tap) < 0 || sv->sv_ix->ix_bad) {
+			fprintf(stderr, "%s: can't index\n", files[i]);
+			return 1;
+		}
+		if (use_index)
+			(void) idx_save(sv->sv_ix);
+	}
+
+	/* only ever remove a stale socket, never some other file */
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, sock);
+	if (lstat(sock, &st) == 0 && S_ISSOCK(st.st_mode))
+		(void) unlink(sock);
+	sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sfd < 0 || bind(sfd, (struct sockaddr *)&sa, sizeof sa) < 0 ||
+	    listen(sfd, 64) < 0) {
+		perror(sock);
+		return 1;
+	}
+
+	sock_path = sock;
+	signal(SIGINT, serve_stop);
+	signal(SIGTERM, serve_stop);
+	if (verbose)
+		fprintf(stderr, "serving %d images on %s\n", nserved, sock);
+
+	while (1) {
+		/* reap finished children; at the limit, wait for one */
+		while (nchild > 0 &&
+		       waitpid(-1, NULL, nchild < SERVE_MAXCHILD ? WNOHANG : 0) > 0)
+			nchild--;
+
+		cfd = accept(sfd, NULL, NULL);
+		if (cfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			break;
+		}
+
+		fflush(stdout);
+		fflush(stderr);
+		pid = fork();
+		if (pid == 0) {
+			signal(SIGINT, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+			close(sfd);
+			exit(serve_request(cfd));
+		}
+		if (pid < 0)
+			perror("fork");
+		else
+			nchild++;
+		close(cfd);
+	}
+
+	(void) unlink(sock);
+	close(sfd);
+	return 1;
+}
+
+
 /*
  * Main program.
  */
@@ -480,51 +1414,273 @@ char *prog;
 
 void usage(int ec)
 {
-	fprintf(stderr, "Usage: %s [-3aOv] -f path.tap [-r | -t | -d files... | -x files...]\n",
+	fprintf(stderr, "Usage: %s [-3aHIkNORv] [-L limits] [-P policy] [-F sect] [-c store] [-m manifest] [-q n] [-s slice] [-w secs] -f path.tap [-b | -r | -t | -M name | -d files... | -x files...]\n",
+		prog);
+	fprintf(stderr, "       %s [-v] -C catalog [-u [-f path.tap]... images... | -Q query]\n",
 		prog);
-	fprintf(stderr, " -f   file in SIMH tape format (required)\n");
+	fprintf(stderr, "       %s [-3aHIlv] -S socket [-f path.tap]... images...\n",
+		prog);
+	fprintf(stderr, "       %s [-v] -A store [-f path.tap]... images...\n",
+		prog);
+	fprintf(stderr, "       %s [-HIv] -E -f old.tap -f new.tap\n", prog);
+	fprintf(stderr, " -f   file in SIMH tape format (required), "
+			"- for stdin;\n");
+	fprintf(stderr, "      repeat for each volume of a multi-volume set\n");
 	fprintf(stderr, "operations:\n");
+	fprintf(stderr, " -A s add images to block store s, as s/name.tapd\n");
+	fprintf(stderr, " -b   show tape block offsets and sizes only\n");
 	fprintf(stderr, " -d   show structure of PFDUMP record\n");
+	fprintf(stderr, " -E   compare records of two images, one per -f\n");
+	fprintf(stderr, " -Q q search catalog: name=pat,type=t,ui=n,"
+			"after=yy/mm/dd,before=yy/mm/dd,tape=pat\n");
+	fprintf(stderr, " -M n merge replicas of one tape, one per -f, "
+			"into n.tap\n");
 	fprintf(stderr, " -r   show raw tape block structure\n");
+	fprintf(stderr, " -S s serve catalog, extract and stream requests for "
+			"images on socket s\n");
 	fprintf(stderr, " -t   catalog the tape\n");
+	fprintf(stderr, " -u   add images to catalog, - reads names from stdin\n");
 	fprintf(stderr, " -x   extract files from tape\n");
 	fprintf(stderr, "modifiers:\n");
 	fprintf(stderr, " -3   use 63-character set (default 64)\n");
 	fprintf(stderr, " -a   extract in ASCII mode (6/12 display code)\n");
+	fprintf(stderr, " -C c collection catalog file for -u and -Q\n");
+	fprintf(stderr, " -c d with -x, keep one copy of each distinct file "
+			"in store d\n");
+	fprintf(stderr, " -F f only labeled file sections: id=pattern, "
+			"seq=n or seq=lo-hi\n");
+	fprintf(stderr, " -H   hash each record's data words (XXH64) for -tv "
+			"and the manifest;\n");
+	fprintf(stderr, "      -HH also SHA-256\n");
+	fprintf(stderr, " -I   don't read or write the image.tap.idx index\n");
+	fprintf(stderr, " -k   with -m, resume: skip records already "
+			"extracted intact\n");
+	fprintf(stderr, " -L l limits: block=bytes (default 1048576), "
+			"words=n, time=seconds\n");
+	fprintf(stderr, "      per tape block and per record; 0 for no limit\n");
 	fprintf(stderr, " -l   list contents of user libraries\n");
+	fprintf(stderr, " -m m with -x, record each file extracted in "
+			"manifest m\n");
+	fprintf(stderr, " -N   with -t, also catalog files in PFDUMP and "
+			"DUMPPF records\n");
 	fprintf(stderr, " -O   extract to stdout (default write to file)\n");
+	fprintf(stderr, " -P p page cache policy: seq, drop (behind cursor), "
+			"direct (O_DIRECT);\n");
+	fprintf(stderr, "      prealloc to preallocate extracted images\n");
+	fprintf(stderr, " -q n read ahead n blocks of 256KB in a helper thread\n");
+	fprintf(stderr, " -R   recover from bad blocks by scanning for the "
+			"next valid one\n");
+	fprintf(stderr, " -s s only records starting in slice: bytes=lo-hi, "
+			"blocks=lo-hi,\n");
+	fprintf(stderr, "      shard=i/n (ith of n parts, from 0); "
+			"-t and -x only\n");
 	fprintf(stderr, " -v   verbose output\n");
 	fprintf(stderr, " -vv  more verbose output\n");
+	fprintf(stderr, " -w s follow an image that is still being written, "
+			"until no new data\n");
+	fprintf(stderr, "      for s seconds\n");
 	exit(ec);
 }
 
 
+/* parse -L suboptions */
+/* returns -1 if invalid */
+int parse_limits(char *opts)
+{
+	static char *tokens[] = { "block", "words", "time", NULL };
+	static long max[] = { UINT32_MAX, INT_MAX, INT_MAX };
+	char *val, *ep;
+	long n;
+	int i;
+
+	while (*opts) {
+		i = getsubopt(&opts, tokens, &val);
+		if (i < 0 || !val) {
+			fprintf(stderr, "invalid limit %s\n", val ? val : "");
+			return -1;
+		}
+		errno = 0;
+		n = strtol(val, &ep, 0);
+		if (*ep || ep == val || n < 0 || n > max[i] || errno) {
+			fprintf(stderr, "invalid limit %s=%s\n", tokens[i], val);
+			return -1;
+		}
+		switch (i) {
+		    case 0:   tap_maxblock = n; break;
+		    case 1:   cdc_maxwords = n; break;
+		    case 2:   cdc_maxtime = n; break;
+		}
+	}
+	return 0;
+}
+
+
+/* parse -P policies */
+/* returns -1 if invalid */
+int parse_policy(char *opts)
+{
+	static char *tokens[] = { "seq", "drop", "direct", "prealloc", NULL };
+	char *val;
+
+	while (*opts) {
+		switch (getsubopt(&opts, tokens, &val)) {
+		    case 0:   tap_iopolicy = TAP_IO_SEQ; break;
+		    case 1:   tap_iopolicy = TAP_IO_DROP; break;
+		    case 2:   tap_iopolicy = TAP_IO_DIRECT; break;
+		    case 3:   tap_prealloc = 1; break;
+		    default:
+			fprintf(stderr, "unknown I/O policy %s\n", val);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/* parse -s suboptions */
+/* returns -1 if invalid */
+int parse_slice(char *opts)
+{
+	static char *tokens[] = { "bytes", "blocks", "shard", NULL };
+	char *val, *ep;
+	int i;
+
+	slicing = 1;
+	while (*opts) {
+		i = getsubopt(&opts, tokens, &val);
+		if (i < 0 || !val) {
+			fprintf(stderr, "invalid slice %s\n", val ? val : "");
+			return -1;
+		}
+		switch (i) {
+		    case 0:
+		    case 1:
+			/* lo-hi, or lo- for the rest of the tape */
+			slice_blocks = i;
+			slice_lo = strtoll(val, &ep, 0);
+			if (*ep++ != '-' || slice_lo < 0)
+				goto bad;
+			slice_hi = *ep ? strtoll(ep, &ep, 0) : -1;
+			if (*ep || slice_hi >= 0 && slice_hi < slice_lo)
+				goto bad;
+			break;
+
+		    case 2:
+			shard_i = strtol(val, &ep, 0);
+			if (*ep != '/')
+				goto bad;
+			shard_n = strtol(ep+1, &ep, 0);
+			if (*ep || shard_i < 0 || shard_i >= shard_n)
+				goto bad;
+			break;
+		}
+	}
+	return 0;
+
+    bad:
+	fprintf(stderr, "invalid slice %s=%s\n", tokens[i], val);
+	return -1;
+}
+
+
+/* turn -s options into a byte range of tap */
+/* returns -1 if tap can't be sliced */
+int slice_setup(TAPE *tap)
+{
+	off_t lo = slice_lo, hi = slice_hi;
+	long n = 0;
+
+	if (tap->tp_vols && *tap->tp_vols || tap_seek(tap, 0) < 0) {
+		fprintf(stderr, "%s: -s needs a single seekable image file\n",
+			tap->tp_path);
+		return -1;
+	}
+
+	/* blocks are counted as -b shows them */
+	if (slice_blocks) {
+		while (n < slice_lo && tap_skipblock(tap, NULL, 0) >= 0)
+			n++;
+		lo = tap_tell(tap);
+		while (hi >= 0 && n < slice_hi &&
+		       tap_skipblock(tap, NULL, 0) >= 0)
+			n++;
+		if (hi >= 0)
+			hi = tap_tell(tap);
+		(void) tap_seek(tap, 0);
+	}
+
+	/* shard i of n is the ith of n equal parts of the range */
+	if (hi < 0 || hi > tap->tp_size)
+		hi = tap->tp_size;
+	lo = MIN(lo, hi);
+	slice_lo = lo + (hi - lo) * shard_i / shard_n;
+	slice_hi = lo + (hi - lo) * (shard_i + 1) / shard_n;
+	dprint(("slice_setup: 0x%lx-0x%lx\n", (long)slice_lo,
+		(long)slice_hi));
+	return 0;
+}
+
+
 #define OP_R	1
 #define OP_T	2
 #define OP_X	4
 #define OP_D	8
+#define OP_B	16
+#define OP_M	32
+#define OP_U	64
+#define OP_Q	128
+#define OP_S	256
+#define OP_A	512
+#define OP_E	1024
 
 void main(int argc, char **argv)
 {
-	int c, ec;
+	int c, ec = 0;
 	unsigned op = 0;
-	char *ifile = NULL;
+	char **ifile;
+	int nfile = 0;
+	char *ep, *mname = NULL, *cname = NULL, *query = NULL, *sname = NULL;
+	char *mfname = NULL, *csdir = NULL, *bsdir = NULL;
+	tapidx_t *ix;
 	TAPE *tap;
 
 	prog = strrchr(argv[0], '/');
 	prog = prog ? prog+1 : argv[0];
 
-	while ((c = getopt(argc, argv, "3aDdf:hlOrtvx")) != -1) {
+	ifile = calloc(argc, sizeof(char *));
+	if (!ifile) {
+		perror(prog);
+		exit(1);
+	}
+
+	while ((c = getopt(argc, argv, "3A:abC:c:DdEF:f:HhIkL:lM:m:NOP:Q:q:RrS:s:tuvw:x")) != -1) {
 		switch (c) {
 		    case '3':
 			dcmap[063] = ':';
 			c74map[04] = "%";
 			break;
 
+		    case 'A':
+			op |= OP_A;
+			bsdir = optarg;
+			break;
+
 		    case 'a':
 			ascii++;
 			break;
 
+		    case 'b':
+			op |= OP_B;
+			break;
+
+		    case 'C':
+			cname = optarg;
+			break;
+
+		    case 'c':
+			csdir = optarg;
+			break;
+
 		    case 'D':
 			debug++;
 			break;
@@ -533,34 +1689,121 @@ void main(int argc, char **argv)
 			op |= OP_D;
 			break;
 
+		    case 'E':
+			op |= OP_E;
+			break;
+
+		    case 'F':
+			if (fs_select(optarg) < 0)
+				usage(1);
+			sections = 1;
+			break;
+
 		    case 'f':
-			ifile = optarg;
+			ifile[nfile++] = optarg;
+			break;
+
+		    case 'H':
+			cdc_hashing = cdc_hashing ? HASH_FAST | HASH_SHA256 :
+						    HASH_FAST;
 			break;
 
 		    case 'h':
 			usage(0);
 			break;
 
+		    case 'I':
+			use_index = 0;
+			break;
+
+		    case 'k':
+			resume++;
+			break;
+
+		    case 'L':
+			if (parse_limits(optarg) < 0)
+				usage(1);
+			break;
+
 		    case 'l':
 			lfmt++;
 			break;
 
+		    case 'M':
+			op |= OP_M;
+			mname = optarg;
+			break;
+
+		    case 'm':
+			mfname = optarg;
+			break;
+
+		    case 'N':
+			nested++;
+			break;
+
 		    case 'O':
 			sout++;
 			break;
 
+		    case 'P':
+			if (parse_policy(optarg) < 0)
+				usage(1);
+			break;
+
+		    case 'Q':
+			op |= OP_Q;
+			query = optarg;
+			break;
+
+		    case 'q':
+			tap_qdepth = strtol(optarg, &ep, 0);
+			if (*ep || tap_qdepth < 0) {
+				fprintf(stderr, "invalid queue depth %s\n",
+					optarg);
+				usage(1);
+			}
+			break;
+
+		    case 'R':
+			tap_recover = plausible_block;
+			break;
+
 		    case 'r':
 			op |= OP_R;
 			break;
 
+		    case 'S':
+			op |= OP_S;
+			sname = optarg;
+			break;
+
+		    case 's':
+			if (parse_slice(optarg) < 0)
+				usage(1);
+			break;
+
 		    case 't':
 			op |= OP_T;
 			break;
 
+		    case 'u':
+			op |= OP_U;
+			break;
+
 		    case 'v':
 			verbose++;
 			break;
 
+		    case 'w':
+			tap_follow = strtol(optarg, &ep, 0);
+			if (*ep || tap_follow <= 0) {
+				fprintf(stderr, "invalid follow timeout %s\n",
+					optarg);
+				usage(1);
+			}
+			break;
+
 		    case 'x':
 			op |= OP_X;
 			break;
@@ -578,17 +1821,39 @@ void main(int argc, char **argv)
 		}
 	}
 
-	if (!ifile) {
+	if (op & (OP_U | OP_Q)) {
+		if (!cname) {
+			fprintf(stderr, "-%c needs a catalog, -C\n",
+				op & OP_U ? 'u' : 'Q');
+			usage(1);
+		}
+	}
+
+	/* images to catalog, serve or archive may also be operands */
+	if (op == OP_U || op == OP_S || op == OP_A)
+		while (optind < argc)
+			ifile[nfile++] = argv[optind++];
+
+	if (!nfile && op != OP_Q) {
 		fprintf(stderr, "-f must be specified\n");
 		usage(1);
 	}
 
 	switch (op) {
+	    case OP_A:
+	    case OP_B:
+	    case OP_E:
+	    case OP_M:
+	    case OP_Q:
 	    case OP_R:
+	    case OP_S:
 	    case OP_T:
+	    case OP_U:
 		if (optind < argc) {
 			fprintf(stderr, "files not allowed with -%c\n",
-				op == OP_R ? 'r' : 't');
+				op == OP_B ? 'b' : op == OP_E ? 'E' :
+				op == OP_M ? 'M' :
+				op == OP_Q ? 'Q' : op == OP_R ? 'r' : 't');
 			usage(1);
 		}
 		break;
@@ -603,24 +1868,102 @@ void main(int argc, char **argv)
 
 	    default:
 		fprintf(stderr,
-			"must specify exactly one of -d, -r, -t, or -x\n");
+			"must specify exactly one of -A, -b, -d, -E, -M, -Q, "
+			"-r, -S, -t, -u, or -x\n");
+		usage(1);
+	}
+
+
+	if ((slicing || sections) && op != OP_T && op != OP_X) {
+		fprintf(stderr, "-%c only applies to -t and -x\n",
+			slicing ? 's' : 'F');
+		usage(1);
+	}
+
+	if (cdc_hashing && op != OP_T && op != OP_X && op != OP_S &&
+	    op != OP_E) {
+		fprintf(stderr, "-H only applies to -t, -x, -E and -S\n");
+		usage(1);
+	}
+
+	if (op == OP_E && nfile != 2) {
+		fprintf(stderr, "-E compares two images, one per -f\n");
+		usage(1);
+	}
+
+	if ((mfname || resume) && op != OP_X || resume && !mfname ||
+	    mfname && sout) {
+		fprintf(stderr, "-m and -k need -x, -k needs -m, "
+				"-O has no files to record\n");
 		usage(1);
 	}
 
+	if (csdir && (op != OP_X || sout)) {
+		fprintf(stderr, "-c needs -x, and -O has no files to store\n");
+		usage(1);
+	}
+
+	/* one entry per line, nothing hidden: slices' catalogs concatenate */
+	if (slicing && op == OP_T) {
+		lfmt = 1;
+		if (!verbose)
+			verbose = 1;
+	}
 
 	if (debug)
 		setbuf(stdout, NULL);
+	else if (tap_follow)
+		setvbuf(stdout, NULL, _IOLBF, 0);
+
+	/* each -f is a replica, not a volume */
+	if (op == OP_M)
+		exit(do_mopt(ifile, nfile, mname));
+
+	/* each -f is an image to compare, by record hashes */
+	if (op == OP_E) {
+		if (!cdc_hashing)
+			cdc_hashing = HASH_FAST;
+		exit(do_eopt(ifile));
+	}
+
+	/* collection catalog: each -f is an image */
+	if (op == OP_U)
+		exit(cat_update(cname, ifile, nfile, use_index));
+	if (op == OP_Q)
+		exit(cat_query(cname, query));
 
-	if (!(tap = tap_open(ifile, NULL))) {
-		perror(ifile);
+	/* each -f is an image to serve */
+	if (op == OP_S)
+		exit(do_sopt(sname, ifile, nfile));
+
+	/* each -f is an image to archive */
+	if (op == OP_A)
+		exit(bs_archive(bsdir, ifile, nfile));
+
+	if (!(tap = tap_open(ifile[0], NULL))) {
+		perror(ifile[0]);
+		exit(1);
+	}
+	tap_setvols(tap, ifile+1);
+	if (slicing && slice_setup(tap) < 0 ||
+	    mfname && mf_open(mfname, tap, resume) < 0 ||
+	    csdir && cs_open(csdir) < 0) {
+		tap_close(tap);
 		exit(1);
 	}
 
 	switch (op) {
+	    case OP_B:	ec = do_bopt(tap); break;
 	    case OP_D:	ec = do_dopt(tap, argc-optind, argv+optind); break;
 	    case OP_R:	ec = do_ropt(tap); break;
 	    case OP_T:	ec = do_topt(tap); break;
-	    case OP_X:	ec = do_xopt(tap, argc-optind, argv+optind); break;
+	    case OP_X:
+		ix = use_index ? idx_load(tap) : NULL;
+		ec = do_xopt(tap, ix, argc-optind, argv+optind);
+		idx_free(ix);
+		mf_close();
+		cs_close();
+		break;
 	}
 
 	tap_close(tap);
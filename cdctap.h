@@ -22,6 +22,7 @@
 #define dprint(x)	if (debug) printf x
 
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
 
 extern int debug;
 extern int verbose;
@@ -0,0 +1,384 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Content-addressed store of extracted files.
+ *
+ * With -c dir, each file extracted is looked up in dir by the SHA-256
+ * hash of its contents, as dir/ab/cdef... (the hash in hex, split after
+ * two digits).  Stored copies are read-only.  A file is hashed as it is
+ * written: a text file is collected in memory and only written out if
+ * it isn't stored yet, and an image is hashed block by block as it goes
+ * to disk.  A file already stored becomes a clone of the stored copy,
+ * so its blocks are shared but each name can still be changed on its
+ * own.  Where the file system can't clone, it becomes a hard link to
+ * the read-only stored copy instead.  Either way, each distinct file
+ * takes up space once.  The store must be on the same file system as
+ * the files extracted.
+ *
+ * dir/names gets a line "hash size path" for every file extracted, so a
+ * file's copies can be found from any of their names.
+ */
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include "cdctap.h"
+#include "cstore.h"
+#include "hash.h"
+
+/* file being extracted */
+typedef struct {
+	char		*cf_name;
+	FILE		*cf_fp;		/* text, collected in cf_buf */
+	char		*cf_buf;
+	size_t		cf_len;
+	hash_t		*cf_hash;	/* image, hashed as written */
+} csfile_t;
+
+static char *cs_dir = NULL;
+static FILE *cs_names;
+
+/* files of the current record */
+static csfile_t *cs_new;
+static int cs_nnew, cs_maxnew;
+
+static unsigned long cs_nfile, cs_ndup;
+static int64_t cs_saved;
+
+
+/* start storing extracted files in dir */
+/* returns -1 if error */
+int cs_open(char *dir)
+{
+	struct stat dst, cst;
+	char *path;
+
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST ||
+	    stat(dir, &dst) < 0 || stat(".", &cst) < 0) {
+		perror(dir);
+		return -1;
+	}
+	if (dst.st_dev != cst.st_dev) {
+		fprintf(stderr, "%s: not on the same file system as the "
+				"current directory\n", dir);
+		return -1;
+	}
+	path = malloc(strlen(dir) + 7);
+	if (!path) {
+		fprintf(stderr, "%s: out of memory\n", dir);
+		return -1;
+	}
+	sprintf(path, "%s/names", dir);
+	cs_names = fopen(path, "a");
+	if (!cs_names) {
+		perror(path);
+		free(path);
+		return -1;
+	}
+	free(path);
+	cs_dir = dir;
+	return 0;
+}
+
+
+void cs_close(void)
+{
+	if (!cs_dir)
+		return;
+	if (fclose(cs_names) != 0)
+		perror(cs_dir);
+	if (verbose)
+		printf("%lu of %lu files already stored, %" PRId64
+		       " bytes saved\n", cs_ndup, cs_nfile, cs_saved);
+	free(cs_new);
+	cs_dir = NULL;
+}
+
+
+/* returns new entry for fname, NULL if out of memory */
+static csfile_t *cs_add(char *fname)
+{
+	csfile_t *cf;
+
+	if (cs_nnew == cs_maxnew) {
+		cs_maxnew = cs_maxnew ? cs_maxnew * 2 : 8;
+		cf = realloc(cs_new, cs_maxnew * sizeof(csfile_t));
+		if (!cf) {
+			fprintf(stderr, "%s: out of memory\n", cs_dir);
+			return NULL;
+		}
+		cs_new = cf;
+	}
+	cf = &cs_new[cs_nnew];
+	memset(cf, 0, sizeof *cf);
+	if (!(cf->cf_name = strdup(fname))) {
+		fprintf(stderr, "%s: out of memory\n", cs_dir);
+		return NULL;
+	}
+	cs_nnew++;
+	return cf;
+}
+
+
+static void cs_drop(csfile_t *cf)
+{
+	free(cf->cf_name);
+	free(cf->cf_hash);
+	*cf = cs_new[--cs_nnew];
+}
+
+
+/* text file fname has been created as fp; returns stream to write */
+/* its contents to instead, fp itself if not storing */
+FILE *cs_fopen(FILE *fp, char *fname)
+{
+	csfile_t *cf;
+
+	if (!cs_dir || !(cf = cs_add(fname)))
+		return fp;
+	cf->cf_fp = open_memstream(&cf->cf_buf, &cf->cf_len);
+	if (!cf->cf_fp) {
+		perror(fname);
+		cs_drop(cf);
+		return fp;
+	}
+	fclose(fp);
+	return cf->cf_fp;
+}
+
+
+/* image fname has been created as ot: hash it as it's written */
+void cs_tap(TAPE *ot, char *fname)
+{
+	csfile_t *cf;
+
+	if (!cs_dir || !(cf = cs_add(fname)))
+		return;
+	if (!(cf->cf_hash = malloc(sizeof(hash_t)))) {
+		fprintf(stderr, "%s: out of memory\n", cs_dir);
+		cs_drop(cf);
+		return;
+	}
+	hash_init(cf->cf_hash, HASH_SHA256);
+	ot->tp_hash = cf->cf_hash;
+}
+
+
+/* make dst share src's blocks; dst's contents must be the same */
+/* returns -1 if the file system can't */
+static int cs_clone(char *src, char *dst, int flags)
+{
+#ifdef FICLONE
+	int sfd, dfd, rv;
+
+	if ((sfd = open(src, O_RDONLY)) < 0)
+		return -1;
+	if ((dfd = open(dst, O_WRONLY | flags, 0444)) < 0) {
+		close(sfd);
+		return -1;
+	}
+	rv = ioctl(dfd, FICLONE, sfd);
+	close(sfd);
+	if (close(dfd) < 0)
+		rv = -1;
+	return rv < 0 ? -1 : 0;
+#else
+	return -1;
+#endif
+}
+
+
+/* write buf to path, opened with flags */
+/* returns -1 if error */
+static int cs_write(char *path, int flags, char *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | flags, 0444)) < 0)
+		return -1;
+	for (; len > 0; buf += n, len -= n)
+		if ((n = write(fd, buf, len)) < 0) {
+			close(fd);
+			return -1;
+		}
+	return close(fd);
+}
+
+
+/* store fname's contents, or make it the copy already stored */
+/* buf holds a text file's contents, and fname is still empty */
+static void cs_file(char *fname, digest_t *d, int64_t size, char *buf)
+{
+	char obj[PATH_MAX], tmp[PATH_MAX], hex[HASH_HEXLEN], *rp;
+	struct stat fst, ost;
+	struct timespec ts[2];
+	int dup = 1;
+
+	/* gone: not finished after all */
+	if (stat(fname, &fst) < 0)
+		return;
+	hash_hex(d, HASH_SHA256, hex);
+	cs_nfile++;
+
+	/* a truncated name could be some other object: don't store */
+	if (snprintf(obj, sizeof obj, "%s/%.2s", cs_dir, hex) >= sizeof obj)
+		goto toolong;
+	if (mkdir(obj, 0777) < 0 && errno != EEXIST) {
+		perror(obj);
+		goto out;
+	}
+	if (snprintf(obj, sizeof obj, "%s/%.2s/%s", cs_dir, hex,
+		     hex+2) >= sizeof obj ||
+	    snprintf(tmp, sizeof tmp, "%s.%ld", obj,
+		     (long)getpid()) >= sizeof tmp)
+		goto toolong;
+
+	if (stat(obj, &ost) < 0) {
+		/* new: put a read-only copy in the store */
+		dup = 0;
+		if (buf ? cs_write(tmp, O_CREAT | O_EXCL, buf, size) < 0 :
+			  cs_clone(fname, tmp, O_CREAT | O_EXCL) < 0) {
+			(void) unlink(tmp);
+
+			/* can't clone: the file itself becomes the copy */
+			if (buf || chmod(fname, 0444) < 0 ||
+			    link(fname, tmp) < 0) {
+				perror(obj);
+				if (!buf)
+					(void) chmod(fname,
+						     fst.st_mode & 07777);
+				goto out;
+			}
+		}
+		if (rename(tmp, obj) < 0) {
+			perror(obj);
+			(void) unlink(tmp);
+			goto out;
+		}
+		dprint(("cs_file: %s stored as %s\n", fname, obj));
+		if (!buf)
+			goto names;
+	} else if (ost.st_size != size) {
+		fprintf(stderr, "%s: size is wrong, not used\n", obj);
+		goto out;
+	}
+
+	/* make fname the stored copy: a clone of it, else a link to it */
+	if (fst.st_dev == ost.st_dev && fst.st_ino == ost.st_ino)
+		goto names;
+	if (cs_clone(obj, fname, 0) == 0) {
+		/* keep the time set_mtime gave it */
+		ts[0] = fst.st_atim;
+		ts[1] = fst.st_mtim;
+		if (!buf)
+			(void) utimensat(AT_FDCWD, fname, ts, 0);
+	} else {
+		if (snprintf(tmp, sizeof tmp, "%s.cs%ld", fname,
+			     (long)getpid()) >= sizeof tmp)
+			goto toolong;
+		if (link(obj, tmp) < 0 || rename(tmp, fname) < 0) {
+			if (errno != EXDEV && errno != EMLINK)
+				perror(fname);
+			(void) unlink(tmp);
+			goto out;
+		}
+	}
+	dprint(("cs_file: %s is a copy of %s\n", fname, obj));
+	if (dup) {
+		cs_ndup++;
+		cs_saved += size;
+	}
+
+    names:
+	buf = NULL;
+	rp = realpath(fname, NULL);
+	fprintf(cs_names, "%s %" PRId64 " %s\n", hex, size, rp ? rp : fname);
+	free(rp);
+
+    out:
+	/* not stored: the text must still be written */
+	if (buf && cs_write(fname, O_TRUNC, buf, size) < 0)
+		perror(fname);
+	return;
+
+    toolong:
+	fprintf(stderr, "%s: path in store too long, not stored\n", fname);
+	goto out;
+}
+
+
+/* finish text file fp, if cs_fopen made it */
+/* returns -1 if it didn't */
+int cs_fclose(FILE *fp)
+{
+	csfile_t *cf;
+	hash_t h;
+	digest_t d;
+	int i;
+
+	for (i = 0; i < cs_nnew; i++)
+		if (cs_new[i].cf_fp == fp)
+			break;
+	if (i == cs_nnew)
+		return -1;
+
+	cf = &cs_new[i];
+	if (fclose(fp) != 0) {
+		perror(cf->cf_name);
+	} else {
+		hash_init(&h, HASH_SHA256);
+		hash_update(&h, cf->cf_buf, cf->cf_len);
+		hash_final(&h, &d);
+		cs_file(cf->cf_name, &d, cf->cf_len, cf->cf_buf);
+	}
+	free(cf->cf_buf);
+	cs_drop(cf);
+	return 0;
+}
+
+
+/* current record is done: store the images it created */
+void cs_done(void)
+{
+	csfile_t *cf;
+	digest_t d;
+
+	if (!cs_dir)
+		return;
+
+	while (cs_nnew > 0) {
+		cf = &cs_new[cs_nnew-1];
+		if (cf->cf_hash) {
+			hash_final(cf->cf_hash, &d);
+			cs_file(cf->cf_name, &d, cf->cf_hash->h_total, NULL);
+		}
+		cs_drop(cf);
+	}
+	if (fflush(cs_names) != 0)
+		perror(cs_dir);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Content-addressed store of extracted files.
+ */
+
+#ifndef _CSTORE_H
+#define _CSTORE_H 1
+
+#include <stdio.h>
+#include "simtap.h"
+
+extern int cs_open(char *dir);
+extern void cs_close(void);
+extern FILE *cs_fopen(FILE *fp, char *fname);
+extern int cs_fclose(FILE *fp);
+extern void cs_tap(TAPE *ot, char *fname);
+extern void cs_done(void);
+
+#endif /* _CSTORE_H */
@@ -0,0 +1,327 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * File sections of an ANSI-labeled tape.
+ *
+ * A section runs from its HDR1 label to the next one.  -F selects
+ * sections by the file identifier and sequence number in HDR1; the
+ * others are passed over a block at a time, without unpacking, or not
+ * read at all when the tape is indexed.
+ */
+
+#define _GNU_SOURCE	/* FNM_CASEFOLD */
+#include <sys/types.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ansi.h"
+#include "cdctap.h"
+#include "fsect.h"
+
+static char *sel_id = NULL;		/* fnmatch pattern */
+static long sel_lo = 0, sel_hi = -1;	/* sequence numbers */
+
+
+/* parse -F suboptions */
+/* returns -1 if invalid */
+int fs_select(char *opts)
+{
+	static char *tokens[] = { "id", "seq", NULL };
+	char *val, *ep;
+	int i;
+
+	while (*opts) {
+		i = getsubopt(&opts, tokens, &val);
+		if (i < 0 || !val) {
+			fprintf(stderr, "invalid section %s\n", val ? val : "");
+			return -1;
+		}
+		switch (i) {
+		    case 0:
+			sel_id = val;
+			break;
+
+		    case 1:
+			/* n, or lo-hi */
+			sel_lo = sel_hi = strtol(val, &ep, 10);
+			if (*ep == '-')
+				sel_hi = strtol(ep+1, &ep, 10);
+			if (*ep || sel_lo < 0 || sel_hi < sel_lo) {
+				fprintf(stderr, "invalid section seq=%s\n", val);
+				return -1;
+			}
+			break;
+		}
+	}
+	return 0;
+}
+
+
+/* decimal label field; returns -1 if not all digits */
+static long lnum(char *sp, int len)
+{
+	long n = 0;
+
+	while (len && *sp == ' ')
+		sp++, len--;
+	if (!len)
+		return -1;
+	while (len--) {
+		if (!isdigit(*sp))
+			return -1;
+		n = n * 10 + *sp++ - '0';
+	}
+	return n;
+}
+
+
+/* fill in fs from an HDR1 or EOF1 label */
+/* returns FS_HDR or FS_EOF, 0 if some other label */
+int fs_label(char *lbuf, fsect_t *fs)
+{
+	int n;
+
+	if (strncmp(lbuf, "EOF1", 4) == 0) {
+		fs->fs_count = lnum(lbuf+54, 6);
+		return FS_EOF;
+	}
+	if (strncmp(lbuf, "HDR1", 4) != 0)
+		return 0;
+
+	memset(fs, 0, sizeof(fsect_t));
+	memcpy(fs->fs_id, lbuf+4, 17);
+	for (n = 17; n > 0 && fs->fs_id[n-1] == ' '; n--)
+		fs->fs_id[n-1] = '\0';
+	fs->fs_seq = lnum(lbuf+31, 4);
+	fs->fs_count = -1;
+	return FS_HDR;
+}
+
+
+int fs_match(fsect_t *fs)
+{
+	if (sel_id && fnmatch(sel_id, fs->fs_id, FNM_CASEFOLD) != 0)
+		return 0;
+	if (sel_hi >= 0 && (fs->fs_seq < sel_lo || fs->fs_seq > sel_hi))
+		return 0;
+	return 1;
+}
+
+
+/* EOF1 block count is advisory; say so if it's wrong */
+static void fs_check(fsect_t *fs)
+{
+	if (verbose && fs->fs_count >= 0 && fs->fs_count != fs->fs_nblocks)
+		fprintf(stderr, "section %d %s: EOF1 block count %ld, "
+				"found %ld\n", fs->fs_seq, fs->fs_id,
+			fs->fs_count, fs->fs_nblocks);
+}
+
+
+/*
+ * Skip the rest of a section whose HDR1 label was just read: header
+ * labels to a tapemark, data blocks to a tapemark without reading them,
+ * then trailer labels to a tapemark.  Only reads forward, so works on
+ * a stream too.
+ * returns -1 if error
+ */
+int fs_skip(TAPE *tap, fsect_t *fs)
+{
+	char *tbuf, lbuf[81];
+	ssize_t n;
+	int part = 0, k;
+
+	fs->fs_off = tap->tp_boff;
+	while (part < 3) {
+		/* no trailer labels: leave next block to be read */
+		if (part == 2) {
+			k = tap_peekblock(tap, lbuf);
+			if (k < 0 || k == 1 && strncmp(lbuf, "HDR", 3) == 0)
+				break;
+		}
+
+		n = part == 1 ? tap_skipblock(tap, NULL, 0) :
+				tap_readblock(tap, &tbuf);
+		if (n == -2)
+			return -1;
+		if (n < 0)
+			break;
+		if (n == 0) {
+			part++;
+			continue;
+		}
+
+		switch (part) {
+		    case 0:
+			/* data with no tapemark after the header labels */
+			if (!is_label(tbuf, n, lbuf)) {
+				part = 1;
+				fs->fs_nblocks++;
+			}
+			break;
+
+		    case 1:
+			fs->fs_nblocks++;
+			break;
+
+		    case 2:
+			(void) fs_label(lbuf, fs);
+			break;
+		}
+	}
+
+	fs->fs_end = tap_tell(tap);
+	dprint(("fs_skip: section %d %s: 0x%lx-0x%lx, %ld blocks\n",
+		fs->fs_seq, fs->fs_id, (long)fs->fs_off, (long)fs->fs_end,
+		fs->fs_nblocks));
+	fs_check(fs);
+	return 0;
+}
+
+
+/*
+ * -F while reading a tape straight through: note each tapemark (kind
+ * IE_MARK), label (IE_LABEL, text in lbuf) or record (IE_REC), and
+ * pass over a section that isn't selected once its HDR1 is read.
+ * Blocks in no section, such as on an unlabeled tape, aren't selected.
+ * *statep starts at 0.
+ * returns 1 if the block is in a selected section, 0 if not, -1 if error
+ */
+int fs_scan(TAPE *tap, int *statep, int kind, char *lbuf)
+{
+	fsect_t fs;
+
+	switch (kind) {
+	    case IE_LABEL:
+		if (fs_label(lbuf, &fs) == FS_HDR) {
+			*statep = FS_SEEN;
+			if (!fs_match(&fs))
+				return fs_skip(tap, &fs) < 0 ? -1 : 0;
+			*statep |= FS_IN;
+		} else if (*statep & FS_IN && strncmp(lbuf, "EOF", 3) == 0)
+			*statep |= FS_TRAILER;
+		break;
+
+	    case IE_MARK:
+		/* tapemark after trailer labels ends the section */
+		if (*statep & FS_TRAILER) {
+			*statep = FS_SEEN;
+			return 1;
+		}
+		break;
+	}
+	return *statep & FS_IN ? 1 : 0;
+}
+
+
+/* say why nothing was selected, given fs_scan's final state */
+void fs_done(int state)
+{
+	if (!(state & FS_SEEN))
+		fprintf(stderr, "-F: tape has no HDR1 labels, "
+				"no sections selected\n");
+}
+
+
+/* sections of an indexed tape, as fs_skip would find them */
+/* returns number of sections, -1 if out of memory */
+static ssize_t fs_map(tapidx_t *ix, fsect_t **mapp)
+{
+	fsect_t *map = NULL, *fs = NULL, *nm;
+	size_t n, nmap = 0, max = 0;
+	idxent_t *ie;
+	int trailer = 0;
+
+	for (n = 0; n < ix->ix_nent; n++) {
+		ie = &ix->ix_ent[n];
+		if (fs && ie->ie_kind == IE_REC)
+			fs->fs_nblocks += ie->ie_nblocks;
+		else if (fs && ie->ie_kind == IE_MARK && trailer) {
+			/* tapemark after trailer labels ends the section */
+			fs->fs_next = n + 1;
+			fs->fs_end = ie->ie_end;
+			fs = NULL;
+		} else if (fs && ie->ie_kind == IE_LABEL &&
+			   strncmp(ie->ie_text, "EOF", 3) == 0) {
+			(void) fs_label(ie->ie_text, fs);
+			trailer = 1;
+		}
+		if (ie->ie_kind != IE_LABEL ||
+		    strncmp(ie->ie_text, "HDR1", 4) != 0)
+			continue;
+
+		/* new section; close the open one before map can move */
+		if (fs) {
+			fs->fs_next = n;
+			fs->fs_end = ie->ie_off;
+		}
+		if (nmap == max) {
+			max = max ? max * 2 : 16;
+			nm = realloc(map, max * sizeof(fsect_t));
+			if (!nm) {
+				free(map);
+				return -1;
+			}
+			map = nm;
+		}
+		fs = &map[nmap++];
+		trailer = 0;
+		(void) fs_label(ie->ie_text, fs);
+		fs->fs_off = ie->ie_off;
+		fs->fs_first = n;
+	}
+	if (fs) {
+		fs->fs_next = ix->ix_nent;
+		fs->fs_end = ix->ix_nent ? ix->ix_ent[ix->ix_nent-1].ie_end : 0;
+	}
+
+	for (n = 0; n < nmap; n++)
+		fs_check(&map[n]);
+	*mapp = map;
+	return nmap;
+}
+
+
+/* flag the entries of ix that are in a selected section, as fs_scan */
+/* returns NULL if out of memory */
+char *fs_keep(tapidx_t *ix)
+{
+	fsect_t *map;
+	ssize_t i, nmap;
+	char *keep;
+
+	keep = calloc(ix->ix_nent + 1, 1);
+	if (!keep)
+		return NULL;
+
+	if ((nmap = fs_map(ix, &map)) < 0) {
+		free(keep);
+		return NULL;
+	}
+	for (i = 0; i < nmap; i++)
+		if (fs_match(&map[i]))
+			memset(keep + map[i].fs_first, 1,
+			       map[i].fs_next - map[i].fs_first);
+	if (!nmap)
+		fs_done(0);
+	free(map);
+	return keep;
+}
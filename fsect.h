@@ -0,0 +1,55 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * File sections of an ANSI-labeled tape.
+ */
+
+#ifndef _FSECT_H
+#define _FSECT_H 1
+
+#include "tapidx.h"
+
+/* HDR1 labels, tapemark, data, tapemark, EOF1 labels, tapemark */
+typedef struct {
+	char		fs_id[18];	/* file identifier */
+	int		fs_seq;		/* file sequence number, -1 if none */
+	off_t		fs_off;		/* HDR1 label */
+	off_t		fs_end;		/* next section */
+	long		fs_nblocks;	/* data blocks found */
+	long		fs_count;	/* EOF1 block count, -1 if none */
+	size_t		fs_first;	/* index entries, if mapped from one */
+	size_t		fs_next;
+} fsect_t;
+
+#define FS_HDR		1
+#define FS_EOF		2
+
+/* fs_scan state */
+#define FS_IN		1	/* in a selected section */
+#define FS_TRAILER	2	/* and past its trailer labels */
+#define FS_SEEN		4	/* some HDR1 label has been read */
+
+extern int fs_select(char *opts);
+extern int fs_label(char *lbuf, fsect_t *fs);
+extern int fs_match(fsect_t *fs);
+extern int fs_skip(TAPE *tap, fsect_t *fs);
+extern int fs_scan(TAPE *tap, int *statep, int kind, char *lbuf);
+extern void fs_done(int state);
+extern char *fs_keep(tapidx_t *ix);
+
+#endif /* _FSECT_H */
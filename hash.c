@@ -0,0 +1,293 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Content hashes: XXH64 for speed, SHA-256 for fixity.
+ *
+ * XXH64 (seed 0) is Yann Collet's xxHash; SHA-256 is FIPS 180-4.  Both
+ * are computed in one pass over the data, SHA-256 only if asked for.
+ */
+
+#include <endian.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "hash.h"
+
+#define P1	11400714785074694791ULL
+#define P2	14029467366897019727ULL
+#define P3	1609587929392839161ULL
+#define P4	9650029242287828579ULL
+#define P5	2870177450012600261ULL
+
+#define ROTL64(x, n)	((x) << (n) | (x) >> (64 - (n)))
+#define ROTR32(x, n)	((x) >> (n) | (x) << (32 - (n)))
+
+static const uint32_t sha_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b,
+	0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01,
+	0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7,
+	0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152,
+	0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+	0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
+	0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08,
+	0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f,
+	0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+static uint64_t get64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, 8);
+	return le64toh(v);
+}
+
+
+static uint64_t xxh_round(uint64_t acc, uint64_t in)
+{
+	acc += in * P2;
+	acc = ROTL64(acc, 31);
+	return acc * P1;
+}
+
+
+static uint64_t xxh_merge(uint64_t h, uint64_t v)
+{
+	h ^= xxh_round(0, v);
+	return h * P1 + P4;
+}
+
+
+/* XXH64 of whole 32-byte stripes */
+static void xxh_stripes(hash_t *h, const unsigned char *p, size_t n)
+{
+	uint64_t v0 = h->h_v[0], v1 = h->h_v[1], v2 = h->h_v[2],
+		 v3 = h->h_v[3];
+
+	for (; n; n--, p += 32) {
+		v0 = xxh_round(v0, get64(p));
+		v1 = xxh_round(v1, get64(p+8));
+		v2 = xxh_round(v2, get64(p+16));
+		v3 = xxh_round(v3, get64(p+24));
+	}
+	h->h_v[0] = v0;
+	h->h_v[1] = v1;
+	h->h_v[2] = v2;
+	h->h_v[3] = v3;
+}
+
+
+/* SHA-256 of whole 64-byte blocks */
+static void sha_blocks(hash_t *h, const unsigned char *p, size_t n)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, hh, t1, t2;
+	int i;
+
+	for (; n; n--, p += 64) {
+		for (i = 0; i < 16; i++)
+			w[i] = (uint32_t)p[4*i] << 24 | p[4*i+1] << 16 |
+			       p[4*i+2] << 8 | p[4*i+3];
+		for (; i < 64; i++)
+			w[i] = w[i-16] + w[i-7] +
+			       (ROTR32(w[i-15], 7) ^ ROTR32(w[i-15], 18) ^
+				w[i-15] >> 3) +
+			       (ROTR32(w[i-2], 17) ^ ROTR32(w[i-2], 19) ^
+				w[i-2] >> 10);
+
+		a = h->h_s[0]; b = h->h_s[1]; c = h->h_s[2]; d = h->h_s[3];
+		e = h->h_s[4]; f = h->h_s[5]; g = h->h_s[6]; hh = h->h_s[7];
+		for (i = 0; i < 64; i++) {
+			t1 = hh + (ROTR32(e, 6) ^ ROTR32(e, 11) ^
+				   ROTR32(e, 25)) +
+			     ((e & f) ^ (~e & g)) + sha_k[i] + w[i];
+			t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) +
+			     ((a & b) ^ (a & c) ^ (b & c));
+			hh = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		h->h_s[0] += a; h->h_s[1] += b; h->h_s[2] += c;
+		h->h_s[3] += d; h->h_s[4] += e; h->h_s[5] += f;
+		h->h_s[6] += g; h->h_s[7] += hh;
+	}
+}
+
+
+void hash_init(hash_t *h, int flags)
+{
+	static const uint32_t sha_h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memset(h, 0, sizeof(hash_t));
+	h->h_flags = flags;
+	h->h_v[0] = P1 + P2;
+	h->h_v[1] = P2;
+	h->h_v[2] = 0;
+	h->h_v[3] = -P1;
+	memcpy(h->h_s, sha_h0, sizeof h->h_s);
+}
+
+
+/* buffer partial XXH64 stripe and SHA-256 block, hash whole ones */
+static void hash_part(unsigned char *hbuf, size_t bsize, size_t nbuf,
+		      const unsigned char *p, size_t len, hash_t *h,
+		      void (*fn)(hash_t *, const unsigned char *, size_t))
+{
+	size_t n;
+
+	if (nbuf) {
+		n = bsize - nbuf;
+		if (len < n) {
+			memcpy(hbuf + nbuf, p, len);
+			return;
+		}
+		memcpy(hbuf + nbuf, p, n);
+		fn(h, hbuf, 1);
+		p += n;
+		len -= n;
+	}
+	fn(h, p, len / bsize);
+	memcpy(hbuf, p + len / bsize * bsize, len % bsize);
+}
+
+
+void hash_update(hash_t *h, void *buf, size_t len)
+{
+	if (h->h_flags & HASH_FAST)
+		hash_part(h->h_xbuf, 32, h->h_total % 32, buf, len, h,
+			  xxh_stripes);
+	if (h->h_flags & HASH_SHA256)
+		hash_part(h->h_sbuf, 64, h->h_total % 64, buf, len, h,
+			  sha_blocks);
+	h->h_total += len;
+}
+
+
+/* h is left as it was, so more may be added */
+void hash_final(hash_t *hp, digest_t *d)
+{
+	hash_t hc = *hp, *h = &hc;
+	unsigned char *p, pad[128];
+	uint64_t v, bits;
+	size_t n;
+	int i;
+
+	memset(d, 0, sizeof(digest_t));
+
+	if (h->h_flags & HASH_FAST) {
+		if (h->h_total >= 32)
+			v = xxh_merge(xxh_merge(xxh_merge(xxh_merge(
+				ROTL64(h->h_v[0], 1) + ROTL64(h->h_v[1], 7) +
+				ROTL64(h->h_v[2], 12) + ROTL64(h->h_v[3], 18),
+				h->h_v[0]), h->h_v[1]), h->h_v[2]), h->h_v[3]);
+		else
+			v = P5;
+		v += h->h_total;
+
+		p = h->h_xbuf;
+		for (n = h->h_total % 32; n >= 8; n -= 8, p += 8) {
+			v ^= xxh_round(0, get64(p));
+			v = ROTL64(v, 27) * P1 + P4;
+		}
+		if (n >= 4) {
+			v ^= (uint64_t)(p[0] | p[1] << 8 | p[2] << 16 |
+					(uint32_t)p[3] << 24) * P1;
+			v = ROTL64(v, 23) * P2 + P3;
+			p += 4;
+			n -= 4;
+		}
+		for (; n; n--, p++) {
+			v ^= *p * P5;
+			v = ROTL64(v, 11) * P1;
+		}
+		v ^= v >> 33;
+		v *= P2;
+		v ^= v >> 29;
+		v *= P3;
+		v ^= v >> 32;
+		d->hd_fast = v;
+	}
+
+	if (h->h_flags & HASH_SHA256) {
+		/* 0x80, zeros, then bit length, to a whole block */
+		n = h->h_total % 64;
+		memcpy(pad, h->h_sbuf, n);
+		pad[n++] = 0x80;
+		while (n % 64 != 56)
+			pad[n++] = 0;
+		bits = h->h_total * 8;
+		for (i = 7; i >= 0; i--)
+			pad[n++] = bits >> (8 * i);
+		sha_blocks(h, pad, n / 64);
+		for (i = 0; i < 32; i++)
+			d->hd_sha[i] = h->h_s[i/4] >> (24 - 8 * (i % 4));
+	}
+}
+
+
+/* XXH64 in hex, then ",SHA-256" if that too */
+char *hash_hex(digest_t *d, int flags, char *buf)
+{
+	char *bp = buf;
+	int i;
+
+	if (flags & HASH_FAST)
+		bp += sprintf(bp, "%016" PRIx64, d->hd_fast);
+	if (flags & HASH_SHA256) {
+		if (bp > buf)
+			*bp++ = ',';
+		for (i = 0; i < 32; i++)
+			bp += sprintf(bp, "%02x", d->hd_sha[i]);
+	}
+	*bp = '\0';
+	return buf;
+}
+
+
+/* hash a file's contents */
+/* returns -1 if unreadable */
+int hash_file(char *path, int flags, digest_t *d, int64_t *sizep)
+{
+	char buf[65536];
+	int64_t size = 0;
+	hash_t h;
+	size_t n;
+	FILE *fp;
+
+	if (!(fp = fopen(path, "r")))
+		return -1;
+	hash_init(&h, flags);
+	while ((n = fread(buf, 1, sizeof buf, fp)) > 0) {
+		hash_update(&h, buf, n);
+		size += n;
+	}
+	if (ferror(fp)) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	hash_final(&h, d);
+	*sizep = size;
+	return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Content hashes: XXH64 for speed, SHA-256 for fixity.
+ */
+
+#ifndef _HASH_H
+#define _HASH_H 1
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define HASH_FAST	1		/* XXH64 */
+#define HASH_SHA256	2
+
+typedef struct {
+	int		h_flags;
+	uint64_t	h_total;
+	uint64_t	h_v[4];		/* XXH64 lanes */
+	unsigned char	h_xbuf[32];
+	uint32_t	h_s[8];		/* SHA-256 state */
+	unsigned char	h_sbuf[64];
+} hash_t;
+
+typedef struct {
+	uint64_t	hd_fast;
+	unsigned char	hd_sha[32];
+} digest_t;
+
+extern void hash_init(hash_t *h, int flags);
+extern void hash_update(hash_t *h, void *buf, size_t len);
+extern void hash_final(hash_t *h, digest_t *d);
+extern char *hash_hex(digest_t *d, int flags, char *buf);
+extern int hash_file(char *path, int flags, digest_t *d, int64_t *sizep);
+
+/* size of hash_hex buffer */
+#define HASH_HEXLEN	(16 + 1 + 64 + 1)
+
+#endif /* _HASH_H */
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "cdctap.h"
 #include "ifmt.h"
 #include "simtap.h"
@@ -30,8 +31,18 @@
 #define CDC_CBUFSZ      (512*10)
 #define CDC_TBUFSZ      (CDC_CBUFSZ*6/8+6)
 
+/* bytes at end of a tape block that always contain its trailer */
+#define CDC_TAILSZ	16
+
 int cdc_flushblock(cdc_ctx_t *cd, int eof);
 
+/* per-record limits on words read and seconds spent; 0=unlimited */
+int cdc_maxwords = 0;
+int cdc_maxtime = 0;
+
+/* HASH_ flags: hash the data words of each record read */
+int cdc_hashing = 0;
+
 
 int unpack6(char *dst, char *src, int nbytes)
 {
@@ -99,6 +110,57 @@ int pack6(char *dst, char *src, int nchar)
 }
 
 
+/* note that the block just read starts at record word word */
+/* returns 1 if it hasn't been seen before */
+static int cdc_mapblock(cdc_ctx_t *cd, int word, int nwords)
+{
+	cdc_bmap_t *nm;
+	int n = cd->cd_nextblk++;
+
+	/* seen before, re-read after a seek */
+	if (n < cd->cd_nblocks)
+		return 0;
+	cd->cd_nblocks++;
+
+	/* map stops growing if out of memory; seeks back then fail */
+	if (n != cd->cd_nmap)
+		return 1;
+	if (cd->cd_nmap == cd->cd_maxmap) {
+		nm = realloc(cd->cd_map, (cd->cd_maxmap + 64) * 2 *
+					 sizeof(cdc_bmap_t));
+		if (!nm)
+			return 1;
+		cd->cd_map = nm;
+		cd->cd_maxmap = (cd->cd_maxmap + 64) * 2;
+	}
+	nm = &cd->cd_map[cd->cd_nmap++];
+	nm->bm_off = cd->cd_tap->tp_boff;
+	nm->bm_vol = cd->cd_tap->tp_volno;
+	nm->bm_word = word;
+	nm->bm_nwords = nwords;
+	return 1;
+}
+
+
+/*
+ * Add a new block's data words to the record's hash.  They're hashed
+ * packed, as they lie on tape: 60 bits each, the last odd one padded
+ * with four zero bits.  So the hash is of the record's word stream,
+ * however it was split into blocks, and nothing need be unpacked.
+ */
+static void cdc_hashblock(cdc_ctx_t *cd, char *tbuf, int nwords)
+{
+	int n = nwords * 15 / 2;
+	unsigned char half;
+
+	hash_update(cd->cd_hash, tbuf, n);
+	if (nwords & 1) {
+		half = tbuf[n] & 0xf0;
+		hash_update(cd->cd_hash, &half, 1);
+	}
+}
+
+
 /* returns -2 on failure, else number of CDC chars unpacked */
 int unpack_iblock(cdc_ctx_t *cd, char *tbuf, int nbytes)
 {
@@ -142,12 +204,90 @@ int unpack_iblock(cdc_ctx_t *cd, char *tbuf, int nbytes)
 		nwords = rv / 10;
 	}
 
+	if (cdc_mapblock(cd, cd->cd_reclen, nwords) && cd->cd_hash)
+		cdc_hashblock(cd, tbuf, nwords);
 	cd->cd_nleft = cd->cd_nchar = nwords * 10;
 	cd->cd_reclen += nwords;
 	return rv;
 }
 
 
+/* get CDC char c of a packed tape block, given its last ntail bytes */
+static int tail6(unsigned char *tail, int ntail, int nbytes, int c)
+{
+	int bit = c * 6;
+	int i = bit / 8 - (nbytes - ntail);
+	int v = tail[i] << 8 | (i + 1 < ntail ? tail[i+1] : 0);
+
+	return v >> (10 - bit % 8) & 077;
+}
+
+
+/* does packed tape block end in a valid trailer? (see unpack_iblock) */
+static int iblock_trailer(unsigned char *tail, int ntail, int nbytes)
+{
+	int c, PPwords;
+
+	if (nbytes < 6)
+		return 0;
+
+	c = (nbytes - 6) * 8 / 60 * 10;
+	PPwords = (c + 8) / 2;
+	return tail6(tail, ntail, nbytes, c) == (PPwords >> 6) &&
+	       tail6(tail, ntail, nbytes, c+1) == (PPwords & 077) &&
+	       !tail6(tail, ntail, nbytes, c+6);
+}
+
+
+/*
+ * Determine number of data words in a packed tape block from just its
+ * trailer, without unpacking the block. Same rules as unpack_iblock.
+ */
+static int iblock_nwords(unsigned char *tail, int ntail, int nbytes)
+{
+	if (nbytes < 6)
+		return 0;
+
+	if (iblock_trailer(tail, ntail, nbytes))
+		return (nbytes - 6) * 8 / 60;
+
+	/* no valid trailer: all full words unpack6 would produce */
+	return (nbytes / 3 * 4 + (nbytes % 3 ? 2 : 0)) / 10;
+}
+
+
+/* block number from I-format trailer, -1 if no valid trailer */
+int cdc_iblock_num(char *tbuf, int nbytes)
+{
+	int ntail = MIN(nbytes, CDC_TAILSZ);
+	unsigned char *tail = (unsigned char *)tbuf + nbytes - ntail;
+	int c;
+
+	if (nbytes > CDC_TBUFSZ || !iblock_trailer(tail, ntail, nbytes))
+		return -1;
+
+	c = (nbytes - 6) * 8 / 60 * 10;
+	return tail6(tail, ntail, nbytes, c+2) << 18 |
+	       tail6(tail, ntail, nbytes, c+3) << 12 |
+	       tail6(tail, ntail, nbytes, c+4) << 6 |
+	       tail6(tail, ntail, nbytes, c+5);
+}
+
+
+/* plausible I-format tape block? used when resynchronizing a bad image */
+int cdc_valid_iblock(char *tbuf, int nbytes)
+{
+	return cdc_iblock_num(tbuf, nbytes) >= 0;
+}
+
+
+/* does a tape block of nbytes end its record? only full blocks don't */
+int cdc_block_eor(int nbytes)
+{
+	return nbytes * 8 / 6 < CDC_CBUFSZ;
+}
+
+
 /* reading if tbuf != NULL, else writing (nbytes, cbufp ignored) */
 /* return: -1=EOF, -2=failure, else number of CDC chars unpacked */
 int cdc_ctx_init(cdc_ctx_t *cd, TAPE *tap, char *tbuf, int nbytes, char **cbufp)
@@ -156,6 +296,7 @@ int cdc_ctx_init(cdc_ctx_t *cd, TAPE *tap, char *tbuf, int nbytes, char **cbufp)
 
 	memset(cd, 0, sizeof(cdc_ctx_t));
 	cd->cd_tap = tap;
+	cd->cd_start = time(NULL);
 
 	if (tbuf) {
 		*cbufp = NULL;
@@ -164,14 +305,30 @@ int cdc_ctx_init(cdc_ctx_t *cd, TAPE *tap, char *tbuf, int nbytes, char **cbufp)
 					"tape open for writing\n");
 			return -2;
 		}
+		if (cdc_hashing) {
+			cd->cd_hash = malloc(sizeof(hash_t));
+			if (!cd->cd_hash) {
+				fprintf(stderr, "cdc_ctx_init: out of memory "
+						"for hashing\n");
+				return -2;
+			}
+			hash_init(cd->cd_hash, cdc_hashing);
+		}
 
 		rv = unpack_iblock(cd, tbuf, nbytes);
-		if (rv < 0)
+		if (rv < 0) {
+			free(cd->cd_hash);
+			cd->cd_hash = NULL;
 			return rv;
+		}
 
 		if (rv == 8 && cd->cd_cbuf[7] == 017) {
 			free(cd->cd_cbuf);
 			cd->cd_cbuf = NULL;
+			free(cd->cd_map);
+			cd->cd_map = NULL;
+			free(cd->cd_hash);
+			cd->cd_hash = NULL;
 			return -1;
 		}
 		*cbufp = cd->cd_cbuf;
@@ -205,17 +362,79 @@ void cdc_ctx_fini(cdc_ctx_t *cd)
 		free(cd->cd_tbuf);
 	if (cd->cd_cbuf)
 		free(cd->cd_cbuf);
+	free(cd->cd_map);
+	free(cd->cd_hash);
+}
+
+
+/*
+ * Go on reading cd's record in another record, whose first block is
+ * tbuf, as when a dump continues on the next reel.  The word count,
+ * start time and limits carry on; the hash and block map start again,
+ * so blocks of the earlier record can't be sought back to.
+ * return: as cdc_ctx_init
+ */
+int cdc_ctx_next(cdc_ctx_t *cd, char *tbuf, int nbytes, char **cbufp)
+{
+	int rv;
+
+	*cbufp = NULL;
+	cd->cd_nextblk = 0;
+	cd->cd_nblocks = 0;
+	cd->cd_nmap = 0;
+	if (cd->cd_hash)
+		hash_init(cd->cd_hash, cdc_hashing);
+
+	rv = unpack_iblock(cd, tbuf, nbytes);
+	if (rv < 0)
+		return rv;
+	if (rv == 8 && cd->cd_cbuf[7] == 017)
+		return -1;
+	*cbufp = cd->cd_cbuf;
+	return cd->cd_nchar;
+}
+
+
+/* skip one tape block, reading only its trailer, or all of it if hashing */
+/* returns number of data words, -1 if EOF, -2 if error */
+static int cdc_skipblock(cdc_ctx_t *cd)
+{
+	ssize_t nbytes;
+	int nwords;
+	unsigned char tbuf[CDC_TAILSZ], *tail = tbuf;
+	char *bp = NULL;
+
+	if (cd->cd_hash) {
+		nbytes = tap_readblock(cd->cd_tap, &bp);
+		if (nbytes > 0)
+			tail = (unsigned char *)bp + nbytes -
+			       MIN(nbytes, CDC_TAILSZ);
+	} else
+		nbytes = tap_skipblock(cd->cd_tap, (char *)tbuf, sizeof tbuf);
+	if (nbytes < 0)
+		return nbytes;
+
+	if (cdc_block_eor(nbytes))
+		/* partial block: get actual data size from trailer */
+		nwords = iblock_nwords(tail, MIN(nbytes, CDC_TAILSZ), nbytes);
+	else
+		/* full block */
+		nwords = nbytes * 8 / 60;
+	if (cdc_mapblock(cd, cd->cd_reclen, nwords) && bp)
+		cdc_hashblock(cd, bp, nwords);
+	cd->cd_nchar = nwords * 10;
+	cd->cd_reclen += nwords;
+	return nwords;
 }
 
 
 /* skip over tape blocks until CDC EOR */
+/* full blocks are skipped unread, short ones only have trailer decoded */
 /* returns record size in CDC words, negative if error */
 int cdc_skipr(cdc_ctx_t *cd)
 {
-	ssize_t nbytes;
 	int nwords;
-	char *tbuf;
-	
+
 	if (tap_is_write(cd->cd_tap)) {
 		fprintf(stderr, "cdc_skipr: attempt to read "
 				"tape open for writing\n");
@@ -223,21 +442,13 @@ int cdc_skipr(cdc_ctx_t *cd)
 	}
 
 	while (cd->cd_nchar >= CDC_CBUFSZ) {
-		nbytes = tap_readblock(cd->cd_tap, &tbuf);
-		if (nbytes == -2)
+		nwords = cdc_skipblock(cd);
+		if (nwords == -2)
 			return -1;
-		if (nbytes < 0)
+		if (nwords < 0) {
+			/* EOF inside record: don't read past it again */
+			cd->cd_nchar = 0;
 			break;
-
-		if (nbytes * 8 / 6 < CDC_CBUFSZ) {
-			/* unpack partial block to get actual data size */
-			(void) unpack_iblock(cd, tbuf, nbytes);
-
-		} else {
-			/* full block */
-			nwords = nbytes * 8 / 60;
-			cd->cd_nchar = nwords * 10;
-			cd->cd_reclen += nwords;
 		}
 	}
 	cd->cd_nleft = 0;
@@ -246,53 +457,171 @@ int cdc_skipr(cdc_ctx_t *cd)
 }
 
 
-/* get next CDC word after advancing nskip words */
-/* returns NULL if EOR or error */
-char *cdc_skipwords(cdc_ctx_t *cd, int nskip)
+/* hash of the record's data words, once cdc_skipr has read it to EOR */
+/* returns -1 if not hashing */
+int cdc_digest(cdc_ctx_t *cd, digest_t *d)
+{
+	if (!cd->cd_hash)
+		return -1;
+	hash_final(cd->cd_hash, d);
+	return 0;
+}
+
+
+/* check per-record limits before reading another block */
+/* returns nonzero if record should be abandoned */
+static int cdc_limit(cdc_ctx_t *cd)
+{
+	if (cd->cd_limit)
+		return 1;
+
+	if (cdc_maxwords && cd->cd_reclen >= cdc_maxwords)
+		fprintf(stderr, "record exceeds %d words\n", cdc_maxwords);
+	else if (cdc_maxtime && time(NULL) - cd->cd_start >= cdc_maxtime)
+		fprintf(stderr, "record exceeds %d seconds\n", cdc_maxtime);
+	else
+		return 0;
+
+	cd->cd_limit = 1;
+	return 1;
+}
+
+
+/* current position in record, in words */
+int cdc_tellword(cdc_ctx_t *cd)
+{
+	return cd->cd_reclen - cd->cd_nleft / 10;
+}
+
+
+/* re-read a block seen earlier; returns -1 if it can't */
+static int cdc_mapread(cdc_ctx_t *cd, int n)
 {
+	cdc_bmap_t *bm = &cd->cd_map[n];
 	ssize_t nbytes;
-	int rv, cskip = nskip * 10;
 	char *tbuf;
 
-	dprint(("cdc_skipwords: skip %d words\n", nskip));
+	dprint(("cdc_mapread: block %d at 0x%lx word %d\n", n,
+		(long)bm->bm_off, bm->bm_word));
+	/* earlier volumes of a set are closed */
+	if (bm->bm_vol != cd->cd_tap->tp_volno) {
+		fprintf(stderr, "%s: can't seek back to block %d "
+				"on an earlier volume\n", cd->cd_tap->tp_path, n);
+		return -1;
+	}
+	if (tap_seek(cd->cd_tap, bm->bm_off) < 0)
+		return -1;
+	nbytes = tap_readblock(cd->cd_tap, &tbuf);
+	if (nbytes < 0)
+		return -1;
+	cd->cd_nextblk = n;
+	cd->cd_reclen = bm->bm_word;
+	return unpack_iblock(cd, tbuf, nbytes) < 0 ? -1 : 0;
+}
+
+
+/*
+ * Position record at word offset word, forward or back, and return it
+ * without consuming it.  Going forward, only the block holding word is
+ * read and unpacked; whole blocks before it are skipped unread.  Going
+ * back, or forward to a block already seen, seeks to that block, so it
+ * needs a seekable tape.
+ * returns NULL if past EOR, error, or record limit exceeded
+ */
+char *cdc_seekword(cdc_ctx_t *cd, int word)
+{
+	ssize_t nbytes;
+	int lo, hi, mid, cur;
+	char *tbuf;
+
+	dprint(("cdc_seekword: word %d\n", word));
 	if (tap_is_write(cd->cd_tap)) {
-		fprintf(stderr, "cdc_skipwords: attempt to read "
+		fprintf(stderr, "cdc_seekword: attempt to read "
 				"tape open for writing\n");
 		return NULL;
 	}
+	if (word < 0 || cd->cd_limit)
+		return NULL;
 
-	/* read next tape block(s) as needed */
-	while (cd->cd_nleft < cskip + 10) {
-		dprint(("cdc_skipwords: nleft=%d, refill\n", cd->cd_nleft));
+	/* first word of block in cd_cbuf */
+	cur = cd->cd_reclen - cd->cd_nchar / 10;
 
-		/* skip remaining chars, ignoring any partial word at end */
-		cskip -= cd->cd_nleft / 10 * 10;
-		cd->cd_nleft = 0;
+	/* behind, or ahead among blocks already seen: go straight there */
+	if (word < cur ||
+	    word >= cd->cd_reclen && cd->cd_nextblk < cd->cd_nmap) {
+		/* words before the map, see cdc_ctx_next */
+		if (!cd->cd_nmap || word < cd->cd_map[0].bm_word)
+			return NULL;
+
+		/* last mapped block starting at or before word */
+		lo = 0;
+		hi = cd->cd_nmap - 1;
+		while (lo < hi) {
+			mid = (lo + hi + 1) / 2;
+			if (cd->cd_map[mid].bm_word <= word)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		if (cdc_mapread(cd, lo) < 0)
+			return NULL;
+	}
 
+	/* read on from here */
+	while (word >= cd->cd_reclen) {
 		/* if EOR, stop */
 		if (cd->cd_nchar < CDC_CBUFSZ) {
-			dprint(("cdc_skipwords: EOR\n"));
+			dprint(("cdc_seekword: EOR\n"));
 			cd->cd_nchar = 0;
+			cd->cd_nleft = 0;
+			return NULL;
+		}
+
+		/* leave rest of record for cdc_skipr */
+		if (cdc_limit(cd))
 			return NULL;
+
+		/* whole block before word: skip it */
+		if (word >= cd->cd_reclen + CDC_CBUFSZ / 10) {
+			if (cdc_skipblock(cd) < 0) {
+				cd->cd_nchar = 0;
+				cd->cd_nleft = 0;
+				return NULL;
+			}
+			cd->cd_nleft = 0;
+
+			/* oversized block held word after all: go back */
+			if (word < cd->cd_reclen &&
+			    (cd->cd_nmap < cd->cd_nblocks ||
+			     cdc_mapread(cd, cd->cd_nmap - 1) < 0))
+				return NULL;
+			continue;
 		}
 
 		/* read next tape block */
 		nbytes = tap_readblock(cd->cd_tap, &tbuf);
-		dprint(("cdc_skipwords: readblock returned %ld\n", nbytes));
+		dprint(("cdc_seekword: readblock returned %ld\n", nbytes));
 		if (nbytes < 0) {
 			cd->cd_nchar = 0;
+			cd->cd_nleft = 0;
 			return NULL;
 		}
 
-		rv = unpack_iblock(cd, tbuf, nbytes);
-		dprint(("cdc_skipwords: unpacked %d chars\n", rv));
-		if (rv < 0)
+		if (unpack_iblock(cd, tbuf, nbytes) < 0)
 			return NULL;
 	}
+	cur = cd->cd_reclen - cd->cd_nchar / 10;
+	cd->cd_nleft = cd->cd_nchar - (word - cur) * 10;
+	return cd->cd_cbuf + (word - cur) * 10;
+}
+
 
-	dprint(("cdc_skipwords: skipping %d chars\n", cskip));
-	cd->cd_nleft -= cskip;
-	return cd->cd_cbuf + cd->cd_nchar - cd->cd_nleft;
+/* get next CDC word after advancing nskip words */
+/* returns NULL if EOR, error, or record limit exceeded */
+char *cdc_skipwords(cdc_ctx_t *cd, int nskip)
+{
+	dprint(("cdc_skipwords: skip %d words\n", nskip));
+	return cdc_seekword(cd, cdc_tellword(cd) + nskip);
 }
 
 
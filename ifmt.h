@@ -22,8 +22,17 @@
 #ifndef _IFMT_H
 #define _IFMT_H 1
 
+#include "hash.h"
 #include "simtap.h"
 
+/* tape block of a record being read, see cdc_seekword */
+typedef struct {
+	off_t	bm_off;		/* offset of SIMH header */
+	int	bm_vol;		/* in this volume of a set */
+	int	bm_word;	/* record word offset of first data word */
+	int	bm_nwords;
+} cdc_bmap_t;
+
 typedef struct {
 	TAPE	*cd_tap;
 	char	*cd_cbuf;	/* unpacked tape block */
@@ -34,13 +43,32 @@ typedef struct {
 	/* fields only for reading: */
 	int	cd_reclen;	/* accumulated CDC record size in words */
 	int	cd_nleft;	/* # CDC chars left to consume from cbuf */
+	time_t	cd_start;	/* when record was started */
+	int	cd_limit;	/* record exceeded a limit, rest unread */
+	int	cd_nblocks;	/* tape blocks of record seen so far */
+	int	cd_nextblk;	/* block number of next block read */
+	cdc_bmap_t *cd_map;	/* where each block seen is, if memory allows */
+	int	cd_nmap;
+	int	cd_maxmap;
+	hash_t	*cd_hash;	/* hash of data words so far, if cdc_hashing */
 } cdc_ctx_t;
 
+extern int cdc_maxwords;
+extern int cdc_maxtime;
+extern int cdc_hashing;
+
 extern int unpack6(char *dst, char *src, int nbytes);
+extern int cdc_iblock_num(char *tbuf, int nbytes);
+extern int cdc_valid_iblock(char *tbuf, int nbytes);
+extern int cdc_block_eor(int nbytes);
 extern int cdc_ctx_init(cdc_ctx_t *cd, TAPE *tap, char *tbuf, int nbytes, char **cbufp);
 extern void cdc_ctx_fini(cdc_ctx_t *cd);
+extern int cdc_ctx_next(cdc_ctx_t *cd, char *tbuf, int nbytes, char **cbufp);
 extern int cdc_skipr(cdc_ctx_t *cd);
+extern int cdc_digest(cdc_ctx_t *cd, digest_t *d);
 extern char *cdc_skipwords(cdc_ctx_t *cd, int nskip);
+extern int cdc_tellword(cdc_ctx_t *cd);
+extern char *cdc_seekword(cdc_ctx_t *cd, int word);
 extern char *cdc_getword(cdc_ctx_t *cd);
 extern int cdc_putword(cdc_ctx_t *cd, char *cp);
 extern int cdc_writer(cdc_ctx_t *cd);
@@ -0,0 +1,444 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Manifest of extracted files, for resuming an interrupted -x.
+ *
+ * A text file, one line per output file:
+ *	offset ordinal ui name rhash size hash path
+ * giving the record's first block offset (hex), its ordinal, user index
+ * (octal, or - if none), name and -H hash (see hash_hex, or - if none),
+ * and the file's size and XXH64 hash, or "- -" from when the file is
+ * created until the record is done, and for good if it wasn't
+ * extracted cleanly.
+ * Lines are flushed as they're written, so after a crash the manifest
+ * tells which outputs are complete and which were left half written.
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cdctap.h"
+#include "hash.h"
+#include "manifest.h"
+#include "outfile.h"
+
+#define MF_MAGIC	"# cdctap manifest"
+
+typedef struct {
+	off_t		me_off;
+	long		me_ord;
+	int		me_ui;
+	char		me_name[8];
+	char		me_rhash[HASH_HEXLEN];	/* "-" if not hashed */
+	int64_t		me_size;	/* -1 if not finished */
+	uint64_t	me_hash;
+	char		*me_path;
+	size_t		me_line;	/* order in manifest */
+} mfent_t;
+
+static FILE *mf_fp = NULL;
+static char *mf_path;
+
+/* record being extracted, and files it has created */
+static mfent_t mf_cur;
+static char **mf_new;
+static int mf_nnew, mf_maxnew;
+
+/* on resume: records whose files are all intact, by offset */
+static mfent_t *mf_good;
+static size_t mf_ngood;
+static off_t mf_roff = -1;		/* where to resume */
+static long mf_rord;
+
+
+/* XXH64 of a file's contents */
+/* returns -1 if unreadable */
+static int mf_hash(char *path, int64_t *sizep, uint64_t *hashp)
+{
+	digest_t d;
+
+	if (hash_file(path, HASH_FAST, &d, sizep) < 0)
+		return -1;
+	*hashp = d.hd_fast;
+	return 0;
+}
+
+
+static void mf_write(FILE *fp, mfent_t *me)
+{
+	fprintf(fp, "%lx %ld ", (long)me->me_off, me->me_ord);
+	if (me->me_ui >= 0)
+		fprintf(fp, "%o ", me->me_ui);
+	else
+		fputs("- ", fp);
+	fprintf(fp, "%s %s ", me->me_name, me->me_rhash);
+	if (me->me_size >= 0)
+		fprintf(fp, "%" PRId64 " %016" PRIx64, me->me_size,
+			me->me_hash);
+	else
+		fputs("- -", fp);
+	fprintf(fp, " %s\n", me->me_path);
+}
+
+
+/* returns -1 if not a manifest line */
+static int mf_parse(char *line, mfent_t *me)
+{
+	char ui[12], size[24], hash[20], *path;
+	long off;
+	int n;
+
+	memset(me, 0, sizeof(mfent_t));
+	if (sscanf(line, "%lx %ld %11s %7s %81s %23s %19s %n", &off,
+		   &me->me_ord, ui, me->me_name, me->me_rhash, size, hash,
+		   &n) != 7 || !line[n])
+		return -1;
+	path = line + n;
+	path[strcspn(path, "\n")] = '\0';
+
+	me->me_off = off;
+	me->me_ui = ui[0] == '-' ? -1 : strtol(ui, NULL, 8);
+	if (size[0] == '-')
+		me->me_size = -1;
+	else {
+		me->me_size = strtoll(size, NULL, 10);
+		me->me_hash = strtoull(hash, NULL, 16);
+	}
+	me->me_path = strdup(path);
+	return me->me_path ? 0 : -1;
+}
+
+
+static int by_path(const void *a, const void *b)
+{
+	const mfent_t *ma = a, *mb = b;
+	int rv = strcmp(ma->me_path, mb->me_path);
+
+	if (rv)
+		return rv;
+	return ma->me_line < mb->me_line ? -1 : ma->me_line > mb->me_line;
+}
+
+
+static int by_off(const void *a, const void *b)
+{
+	const mfent_t *ma = a, *mb = b;
+
+	if (ma->me_off != mb->me_off)
+		return ma->me_off < mb->me_off ? -1 : 1;
+	return ma->me_line < mb->me_line ? -1 : ma->me_line > mb->me_line;
+}
+
+
+/*
+ * Read an existing manifest: remove files left half written, check the
+ * rest against their sizes and hashes, and decide where to resume.  The
+ * manifest is rewritten with just the intact records.
+ * returns -1 if error
+ */
+static int mf_load(char *path, char *hdr)
+{
+	char line[1024], *tmp;
+	mfent_t *ent = NULL, *ne, *me;
+	size_t nent = 0, max = 0, i, j;
+	int64_t size;
+	uint64_t hash;
+	FILE *fp;
+	int bad;
+
+	if (!(fp = fopen(path, "r")))
+		return errno == ENOENT ? 0 : -1;
+	if (!fgets(line, sizeof line, fp) || strcmp(line, hdr) != 0) {
+		fprintf(stderr, "%s: not a manifest of this image\n", path);
+		fclose(fp);
+		return -1;
+	}
+	while (fgets(line, sizeof line, fp)) {
+		if (nent == max) {
+			max = max ? max * 2 : 256;
+			ne = realloc(ent, max * sizeof(mfent_t));
+			if (!ne) {
+				fclose(fp);
+				goto nomem;
+			}
+			ent = ne;
+		}
+		/* a torn last line is just dropped */
+		if (mf_parse(line, &ent[nent]) == 0) {
+			ent[nent].me_line = nent;
+			nent++;
+		}
+	}
+	fclose(fp);
+
+	/* the last line for each path says how it was left; */
+	/* size -2 marks lines to drop, -3 files to extract again */
+	/* (an unfinished file's record may lie before the last done) */
+	qsort(ent, nent, sizeof(mfent_t), by_path);
+	for (i = 0; i < nent; i = j) {
+		for (j = i + 1; j < nent &&
+		     strcmp(ent[j].me_path, ent[i].me_path) == 0; j++)
+			ent[j-1].me_size = -2;
+		me = &ent[j-1];
+		if (me->me_size == -1) {
+			dprint(("mf_load: removing unfinished %s\n",
+				me->me_path));
+			if (unlink(me->me_path) < 0 && errno != ENOENT)
+				perror(me->me_path);
+			me->me_size = -3;
+		} else if (mf_hash(me->me_path, &size, &hash) < 0 ||
+			   size != me->me_size || hash != me->me_hash) {
+			if (verbose)
+				fprintf(stderr, "%s: changed or missing, will "
+						"extract again\n", me->me_path);
+			me->me_size = -3;
+		}
+	}
+
+	/* a record is intact if all its files are; resume at the first */
+	/* that isn't, or else at the last one done */
+	qsort(ent, nent, sizeof(mfent_t), by_off);
+	mf_good = malloc((nent + 1) * sizeof(mfent_t));
+	if (!mf_good)
+		goto nomem;
+	for (i = 0; i < nent; i = j) {
+		bad = 0;
+		for (j = i; j < nent && ent[j].me_off == ent[i].me_off; j++)
+			if (ent[j].me_size == -3)
+				bad = 1;
+		if (bad && mf_roff < 0) {
+			mf_roff = ent[i].me_off;
+			mf_rord = ent[i].me_ord;
+		}
+		for (; i < j; i++) {
+			if (bad || ent[i].me_size < 0)
+				free(ent[i].me_path);
+			else
+				mf_good[mf_ngood++] = ent[i];
+		}
+	}
+	free(ent);
+	if (mf_roff < 0 && mf_ngood) {
+		mf_roff = mf_good[mf_ngood-1].me_off;
+		mf_rord = mf_good[mf_ngood-1].me_ord;
+	}
+	dprint(("mf_load: %lu files intact, resume at 0x%lx\n",
+		(unsigned long)mf_ngood, (long)mf_roff));
+
+	/* rewrite with only the intact records */
+	tmp = malloc(strlen(path) + 5);
+	if (!tmp)
+		return -1;
+	sprintf(tmp, "%s.tmp", path);
+	if (!(fp = fopen(tmp, "w"))) {
+		perror(tmp);
+		free(tmp);
+		return -1;
+	}
+	fputs(hdr, fp);
+	for (i = 0; i < mf_ngood; i++)
+		mf_write(fp, &mf_good[i]);
+	if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+		perror(path);
+		(void) unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+
+    nomem:
+	fprintf(stderr, "%s: out of memory\n", path);
+	for (i = 0; i < nent; i++)
+		free(ent[i].me_path);
+	free(ent);
+	return -1;
+}
+
+
+/* start a manifest for extracting from tap, or resume one */
+/* returns -1 if error */
+int mf_open(char *path, TAPE *tap, int resume)
+{
+	char *hdr, *base;
+
+	/* image is known by size and name, wherever it's read from */
+	base = strrchr(tap->tp_path, '/');
+	base = base ? base+1 : tap->tp_path;
+	hdr = malloc(strlen(base) + 64);
+	if (!hdr) {
+		fprintf(stderr, "%s: out of memory\n", path);
+		return -1;
+	}
+	sprintf(hdr, MF_MAGIC " %ld %s\n", (long)tap->tp_size, base);
+
+	if (resume && mf_load(path, hdr) < 0) {
+		free(hdr);
+		return -1;
+	}
+	mf_fp = fopen(path, resume ? "a" : "w");
+	if (!mf_fp) {
+		perror(path);
+		free(hdr);
+		return -1;
+	}
+	if (ftello(mf_fp) == 0)
+		fputs(hdr, mf_fp);
+	fflush(mf_fp);
+	mf_path = path;
+	free(hdr);
+	return 0;
+}
+
+
+void mf_close(void)
+{
+	size_t i;
+
+	if (!mf_fp)
+		return;
+	if (fclose(mf_fp) != 0)
+		perror(mf_path);
+	mf_fp = NULL;
+
+	for (i = 0; i < mf_ngood; i++)
+		free(mf_good[i].me_path);
+	free(mf_good);
+	free(mf_new);
+}
+
+
+/* record at off is about to be extracted */
+void mf_record(off_t off, long ord, char *name, int ui)
+{
+	mf_cur.me_off = off;
+	mf_cur.me_ord = ord;
+	mf_cur.me_ui = ui;
+	strncpy(mf_cur.me_name, name, sizeof mf_cur.me_name - 1);
+	strcpy(mf_cur.me_rhash, "-");
+	mf_nnew = 0;
+}
+
+
+/* output file fname has been created for the current record */
+void mf_note(char *fname)
+{
+	char **nn;
+
+	if (!mf_fp)
+		return;
+
+	mf_cur.me_size = -1;
+	mf_cur.me_path = fname;
+	mf_write(mf_fp, &mf_cur);
+	fflush(mf_fp);
+
+	if (mf_nnew == mf_maxnew) {
+		mf_maxnew = mf_maxnew ? mf_maxnew * 2 : 8;
+		nn = realloc(mf_new, mf_maxnew * sizeof(char *));
+		if (!nn) {
+			fprintf(stderr, "%s: out of memory\n", mf_path);
+			return;
+		}
+		mf_new = nn;
+	}
+	mf_new[mf_nnew++] = strdup(fname);
+}
+
+
+/* current record is done: its files are complete */
+/* rhash is its -H hash in hex, NULL if none */
+void mf_done(char *rhash)
+{
+	int i;
+
+	if (!mf_fp)
+		return;
+
+	if (rhash)
+		snprintf(mf_cur.me_rhash, sizeof mf_cur.me_rhash, "%s", rhash);
+	for (i = 0; i < mf_nnew; i++) {
+		if (!mf_new[i])
+			continue;
+		mf_cur.me_path = mf_new[i];
+		if (mf_hash(mf_new[i], &mf_cur.me_size, &mf_cur.me_hash) == 0)
+			mf_write(mf_fp, &mf_cur);
+		else
+			perror(mf_new[i]);
+		free(mf_new[i]);
+	}
+	mf_nnew = 0;
+	if (fflush(mf_fp) != 0)
+		perror(mf_path);
+}
+
+
+/* current record failed: leave its files unfinished, for -k to redo */
+void mf_fail(void)
+{
+	int i;
+
+	for (i = 0; i < mf_nnew; i++)
+		free(mf_new[i]);
+	mf_nnew = 0;
+}
+
+
+/* were the files of the record at off extracted and still intact? */
+int mf_ok(off_t off)
+{
+	size_t lo = 0, hi = mf_ngood, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (mf_good[mid].me_off < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < mf_ngood && mf_good[lo].me_off == off;
+}
+
+
+/* offset and ordinal of the record to resume at, -1 to start over */
+off_t mf_resume(long *ordp)
+{
+	*ordp = mf_rord;
+	return mf_roff;
+}
+
+
+/* was a record matching pattern extracted before resuming? */
+int mf_found(char *pattern)
+{
+	char name[8];
+	size_t i;
+
+	for (i = 0; i < mf_ngood; i++) {
+		/* name_match scribbles on name */
+		strcpy(name, mf_good[i].me_name);
+		if (name_match(pattern, name, mf_good[i].me_ui))
+			return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Manifest of extracted files, for resuming an interrupted -x.
+ */
+
+#ifndef _MANIFEST_H
+#define _MANIFEST_H 1
+
+#include "simtap.h"
+
+extern int mf_open(char *path, TAPE *tap, int resume);
+extern void mf_close(void);
+extern void mf_record(off_t off, long ord, char *name, int ui);
+extern void mf_note(char *fname);
+extern void mf_done(char *rhash);
+extern void mf_fail(void);
+extern int mf_ok(off_t off);
+extern off_t mf_resume(long *ordp);
+extern int mf_found(char *pattern);
+
+#endif /* _MANIFEST_H */
@@ -154,7 +154,7 @@ char *extract_opl(cdc_ctx_t *cd, char *name)
 {
 	FILE *of;
 	struct tm tm;
-	char fname[16], deck[8];
+	char fname[40], deck[8];
 	char *cp, *mods;
 	int i, len, nmods, nread;
 	int is_ascii = 0, flags = EXPAND_63_IS_COL;
@@ -298,7 +298,7 @@ char *extract_opl(cdc_ctx_t *cd, char *name)
 char *extract_upl(cdc_ctx_t *cd, char *name, struct tm *tm)
 {
 	FILE *of;
-	char fname[16];
+	char fname[40];
 	char *cp;
 	char *ids;
 	int width = verbose > 1 ? 80 : 72;
@@ -410,7 +410,7 @@ char *extract_upl(cdc_ctx_t *cd, char *name, struct tm *tm)
 char *extract_uplr(cdc_ctx_t *cd, char *name, struct tm *tm)
 {
 	FILE *of;
-	char fname[16];
+	char fname[40];
 	char *cp;
 	int flags = (dcmap[063] == ':') ? 0 : EXPAND_IS_64;
 	int width = verbose > 1 ? 80 : 72;
@@ -26,14 +26,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <alloca.h>
 #undef _POSIX_C_SOURCE  /* I didn't set it; who did?? */
 #include <fnmatch.h>
 #include "cdctap.h"
+#include "cstore.h"
 #include "ifmt.h"
+#include "manifest.h"
 #include "pfdump.h"
 #include "outfile.h"
 
 int sout = 0;
+char out_tag[20];	/* added to output file names, if set */
 
 
 /* match pattern as "ui/pat" or "un/pat" or "pat" */
@@ -131,17 +135,26 @@ FILE *out_open(char *name, char *sfx, char *fname)
 {
 	int i;
 	FILE *rv;
+	char *tname;
 
 	if (sout) {
 		fname[0] = '\0';
 		return stdout;
 	}
 
+	if (out_tag[0]) {
+		tname = alloca(strlen(name) + strlen(out_tag) + 2);
+		sprintf(tname, "%s.%s", name, out_tag);
+		name = tname;
+	}
+
 	sprintf(fname, "%s.%s", name, sfx);
 	for (i = 0; i < 100; i++) {
 		rv = fopen(fname, "wx");
 		if (rv) {
 			printf("Extracting to %s\n", fname);
+			mf_note(fname);
+			rv = cs_fopen(rv, fname);
 			break;
 		}
 		if (errno != EEXIST) {
@@ -157,7 +170,7 @@ FILE *out_open(char *name, char *sfx, char *fname)
 
 void out_close(FILE *of)
 {
-	if (of == stdout)
+	if (of == stdout || cs_fclose(of) == 0)
 		return;
 
 	fclose(of);
@@ -23,6 +23,7 @@
 #define _OUTFILE_H 1
 
 extern int sout;
+extern char out_tag[];
 
 extern FILE *out_open(char *name, char *sfx, char *fname);
 extern void out_close(FILE *of);
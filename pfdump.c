@@ -27,11 +27,15 @@
 #include <errno.h>
 #include <ctype.h>
 #include <time.h>
+#include "ansi.h"
 #include "cdctap.h"
+#include "cstore.h"
 #include "dcode.h"
 #include "ifmt.h"
+#include "manifest.h"
 #include "outfile.h"
 #include "pfdump.h"
+#include "rectype.h"
 #include "simtap.h"
 
 
@@ -182,11 +186,48 @@ void format_catentry(char *dp, char *sp)
 }
 
 
+/*
+ * A dump that fills a reel ends its record with a reel end block and
+ * continues on the next reel, in the record after that reel's dump
+ * label.  Move cd there, past any tapemarks and tape labels, keeping
+ * its word count and limits.
+ * returns -1 if there is no such record
+ */
+static int next_reel(cdc_ctx_t *cd)
+{
+	TAPE *tap = cd->cd_tap;
+	ssize_t nbytes;
+	char *tbuf, *cbuf;
+	char lbuf[81], name[8], date[11], extra[EXTRA_LEN+1];
+	int nchar, ui;
+	rectype_t rt;
+
+	do {
+		(void) cdc_skipr(cd);
+		do {
+			nbytes = tap_readblock(tap, &tbuf);
+		} while (nbytes == 0 ||
+			 nbytes > 0 && is_label(tbuf, nbytes, lbuf));
+		if (nbytes < 0)
+			return -1;
+
+		nchar = cdc_ctx_next(cd, tbuf, nbytes, &cbuf);
+		if (nchar < 0)
+			return -1;
+		rt = id_record(cbuf, nchar, name, date, extra, &ui);
+		dprint(("next_reel: %s %s at 0x%lx\n", rectype[rt], extra,
+			(long)tap_tell(tap)));
+	} while (rt == RT_PFLBL && strcmp(extra, "end") != 0);
+
+	return rt == RT_PFLBL ? -1 : 0;
+}
+
+
 void analyze_pfdump(cdc_ctx_t *cd)
 {
 	char *cp;
 	char cname[8], dword[20];
-	int i, len, lim, max, nread;
+	int i, len, lim, max, nread, reelend;
 	char *btype, *flag;
 	static char *types[8] = {
 		"label",
@@ -218,6 +259,7 @@ void analyze_pfdump(cdc_ctx_t *cd)
 	while (cp = cdc_getword(cd)) {
 		copy_dc(cp, cname, 7, DC_ALNUM);
 		btype = types[cp[7] & 07];
+		reelend = (cp[7] & 07) == 4;
 		flag = flags[(cp[8] >> 3) & 07];
 		len = ((cp[8] & 07) << 6) | cp[9];
 
@@ -255,24 +297,94 @@ void analyze_pfdump(cdc_ctx_t *cd)
 
 		if (!cp) {
 			dprint(("analyze_pfdump: premature CDC EOR at "
-				"0x%lx\n", ftell(cd->cd_tap->tp_fp)));
+				"0x%lx\n", (long)tap_tell(cd->cd_tap)));
 			break;
 		}
 
 		len -= i;
 		dprint(("analyze_pfdump: skip %d\n", len));
+		if (reelend) {
+			if (next_reel(cd) < 0)
+				break;
+			printf("  --next reel--\n");
+			continue;
+		}
 		if (!cdc_skipwords(cd, len))
 			break;
 	}
 }
 
 
-char *extract_pfdump(cdc_ctx_t *cd, char *name)
+/*
+ * Open the image for dumped file name of user ui (-1 if unknown) in a
+ * subdirectory named for the user, or in memory if memp is set.
+ */
+static TAPE *nest_open(char *name, int ui, char *fname, TAPE **memp)
+{
+	char nbuf[40], *dp;
+	TAPE *ot;
+
+	if (memp)
+		return *memp = tap_memopen(NULL, 0, name);
+
+	nbuf[0] = '\0';
+	if (ui >= 0) {
+		/* use subdir for UN (if known) or ui */
+		if ((dp = ui_to_un(ui)) != NULL)
+			sprintf(nbuf, "%s", dp);
+		else
+			sprintf(nbuf, "%o", ui);
+		if (mkdir(nbuf, 0777) < 0 && errno != EEXIST) {
+			fprintf(stderr, "%s: mkdir: ", name);
+			perror(nbuf);
+			return NULL;
+		}
+		strcat(nbuf, "/");
+	}
+	strcat(nbuf, name);
+	if (out_tag[0])
+		sprintf(nbuf + strlen(nbuf), ".%s", out_tag);
+	if ((ot = tap_open(nbuf, fname)) != NULL) {
+		mf_note(fname);
+		cs_tap(ot, fname);
+	}
+	return ot;
+}
+
+
+/* finish the image; one in memory is left open for the caller */
+static void nest_close(TAPE *ot, cdc_ctx_t *ocd, char *fname, struct tm *tm,
+		       TAPE **memp)
+{
+	cdc_ctx_fini(ocd);
+	if (memp)
+		return;
+	tap_close(ot);
+	set_mtime(fname, tm);
+}
+
+
+/* as nest_close, but discard the image */
+static void nest_abort(TAPE *ot, cdc_ctx_t *ocd, TAPE **memp)
+{
+	cdc_ctx_fini(ocd);
+	tap_close(ot);
+	if (memp)
+		*memp = NULL;
+}
+
+
+/*
+ * Extract PFDUMP record to a tape image, or if memp is set, to an
+ * in-memory image returned via *memp.
+ */
+char *extract_pfdump(cdc_ctx_t *cd, char *name, TAPE **memp)
 {
 	TAPE *ot = NULL;
-	char nbuf[16], fname[24], cname[8];
+	char fname[48], cname[8];
 	char *np = name;
-	char *cp, *dp;
+	char *cp;
+	char *err = "EOR while extracting PFDUMP";
 	int ui, btype, flag;
 	int i, len;
 	struct tm tm;
@@ -295,8 +407,7 @@ char *extract_pfdump(cdc_ctx_t *cd, char *name)
 			if (!cp)
 				goto err;
 			if (ot) {
-				cdc_ctx_fini(&ocd);
-				tap_close(ot);
+				nest_abort(ot, &ocd, memp);
 				copy_dc(cp, cname, 7, DC_ALNUM);
 				fprintf(stderr,
 					"%s: multiple PFDUMP catalog entries, "
@@ -321,27 +432,15 @@ char *extract_pfdump(cdc_ctx_t *cd, char *name)
 			tm.tm_sec   = cp[9];
 			tm.tm_isdst = -1;
 	
-			/* use subdir for UN (if known) or ui */
-			if ((dp = ui_to_un(ui)) != NULL)
-				sprintf(nbuf, "%s", dp);
-			else
-				sprintf(nbuf, "%o", ui);
-			if (mkdir(nbuf, 0777) < 0 && errno != EEXIST) {
-				fprintf(stderr, "%s: mkdir: ", np);
-				perror(nbuf);
-				(void) cdc_skipr(cd);
-				return "";
-			}
-			strcat(nbuf, "/");
-			strcat(nbuf, np);
-
-			ot = tap_open(nbuf, fname);
+			ot = nest_open(memp ? name : np, ui, fname, memp);
 			if (!ot) {
 				(void) cdc_skipr(cd);
 				return "";
 			}
 			if (cdc_ctx_init(&ocd, ot, NULL, 0, NULL) < 0) {
 				tap_close(ot);
+				if (memp)
+					*memp = NULL;
 				(void) cdc_skipr(cd);
 				return "";
 			}
@@ -370,6 +469,13 @@ char *extract_pfdump(cdc_ctx_t *cd, char *name)
 
 			continue;
 
+		    case 4:		/* reel end */
+			if (next_reel(cd) < 0) {
+				err = "next reel of PFDUMP not found";
+				goto err;
+			}
+			continue;
+
 		    default:
 			/* skip over other types */
 			break;
@@ -382,26 +488,26 @@ char *extract_pfdump(cdc_ctx_t *cd, char *name)
 	if (!ot)
 		return "no catalog entry in PFDUMP record";
 
-	cdc_ctx_fini(&ocd);
-	tap_close(ot);
-	set_mtime(fname, &tm);
+	nest_close(ot, &ocd, fname, &tm, memp);
 	return NULL;
 
     err:
-	if (ot) {
-		cdc_ctx_fini(&ocd);
-		tap_close(ot);
-	}
+	if (ot)
+		nest_abort(ot, &ocd, memp);
 	(void) cdc_skipr(cd);
-	return "EOR while extracting PFDUMP";
+	return err;
 }
 
 
-char *extract_dumppf(cdc_ctx_t *cd, char *name)
+/*
+ * Extract DUMPPF record to a tape image, or if memp is set, to an
+ * in-memory image returned via *memp.
+ */
+char *extract_dumppf(cdc_ctx_t *cd, char *name, TAPE **memp)
 {
 	TAPE *ot = NULL;
-	char nbuf[16], fname[24];
-	char *cp, *dp;
+	char fname[48];
+	char *cp;
 	int i, len, ui = -1;
 	int pru_size;
 	struct tm tm;
@@ -410,7 +516,6 @@ char *extract_dumppf(cdc_ctx_t *cd, char *name)
 	dprint(("extract_dumppf: %s\n", name));
 	memset(&tm, 0, sizeof tm);
 	tm.tm_hour = 12;
-	nbuf[0] = '\0';
 
 	/* read 7700 table, extract date */
 	cp = cdc_getword(cd);
@@ -477,29 +582,15 @@ char *extract_dumppf(cdc_ctx_t *cd, char *name)
 	if (!cdc_skipwords(cd, len))
 		return "EOR skipping over 7400 table";
 
-	if (ui >= 0) {
-		/* use subdir for UN (if known) or ui */
-		if ((dp = ui_to_un(ui)) != NULL)
-			sprintf(nbuf, "%s", dp);
-		else
-			sprintf(nbuf, "%o", ui);
-		if (mkdir(nbuf, 0777) < 0 && errno != EEXIST) {
-			fprintf(stderr, "%s: mkdir: ", name);
-			perror(nbuf);
-			(void) cdc_skipr(cd);
-			return "";
-		}
-		strcat(nbuf, "/");
-	}
-	strcat(nbuf, name);
-
-	ot = tap_open(nbuf, fname);
+	ot = nest_open(name, ui, fname, memp);
 	if (!ot) {
 		(void) cdc_skipr(cd);
 		return "";
 	}
 	if (cdc_ctx_init(&ocd, ot, NULL, 0, NULL) < 0) {
 		tap_close(ot);
+		if (memp)
+			*memp = NULL;
 		(void) cdc_skipr(cd);
 		return "";
 	}
@@ -539,14 +630,11 @@ char *extract_dumppf(cdc_ctx_t *cd, char *name)
 
 	}
 
-	cdc_ctx_fini(&ocd);
-	tap_close(ot);
-	set_mtime(fname, &tm);
+	nest_close(ot, &ocd, fname, &tm, memp);
 	return NULL;
 
     err:
-	cdc_ctx_fini(&ocd);
-	tap_close(ot);
+	nest_abort(ot, &ocd, memp);
 	(void) cdc_skipr(cd);
 	return "EOR while extracting DUMPPF";
 }
@@ -27,7 +27,7 @@ extern int un_to_ui(char *un);
 extern void format_pflabel(char *dp, char *sp);
 extern void format_catentry(char *dp, char *sp);
 extern void analyze_pfdump(cdc_ctx_t *cd);
-extern char *extract_pfdump(cdc_ctx_t *cd, char *name);
-extern char *extract_dumppf(cdc_ctx_t *cd, char *name);
+extern char *extract_pfdump(cdc_ctx_t *cd, char *name, TAPE **memp);
+extern char *extract_dumppf(cdc_ctx_t *cd, char *name, TAPE **memp);
 
 #endif /* _PFDUMP_H */
@@ -29,6 +29,7 @@
 #include "rectype.h"
 
 
+/* names by rectype_t; NULL ends the table */
 char *rectype[] = {
     "(00)",
     "EOF",
@@ -58,6 +59,7 @@ char *rectype[] = {
     "DUMP",
     "PFDUMP",
     "PFDUMP",
+    NULL
 };
 
 static char *uplstr[] = {
@@ -0,0 +1,240 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Reconcile several captures of the same tape into one best-of image.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ansi.h"
+#include "cdctap.h"
+#include "ifmt.h"
+#include "replica.h"
+#include "simtap.h"
+
+/* kinds of block */
+#define RK_END		0	/* end of tape, or unreadable from here on */
+#define RK_MARK		1
+#define RK_LABEL	2
+#define RK_DATA		3	/* I-format block with valid trailer */
+#define RK_BAD		4	/* anything else */
+
+/* current block of one replica */
+typedef struct {
+	TAPE		*rp_tap;
+	char		*rp_buf;	/* valid until next read of rp_tap */
+	ssize_t		rp_nbytes;
+	int		rp_kind;
+	int		rp_bn;		/* block number, if RK_DATA */
+	char		rp_label[81];	/* label, if RK_LABEL */
+	unsigned long	rp_used;	/* blocks taken from this replica */
+} replica_t;
+
+
+static void rp_next(replica_t *rp)
+{
+	rp->rp_nbytes = tap_readblock(rp->rp_tap, &rp->rp_buf);
+	if (rp->rp_nbytes < 0)
+		rp->rp_kind = RK_END;
+	else if (rp->rp_nbytes == 0)
+		rp->rp_kind = RK_MARK;
+	else if (is_label(rp->rp_buf, rp->rp_nbytes, rp->rp_label))
+		rp->rp_kind = RK_LABEL;
+	else {
+		rp->rp_bn = cdc_iblock_num(rp->rp_buf, rp->rp_nbytes);
+		rp->rp_kind = rp->rp_bn >= 0 ? RK_DATA : RK_BAD;
+	}
+}
+
+
+/* do two replicas hold copies of the same tape block? */
+/* labels of the same kind, e.g. HDR1, are copies; rp_vote picks one */
+static int rp_same(replica_t *a, replica_t *b)
+{
+	if (a->rp_kind != b->rp_kind)
+		return 0;
+	if (a->rp_kind == RK_LABEL)
+		return memcmp(a->rp_label, b->rp_label, 4) == 0;
+	return a->rp_kind != RK_DATA || a->rp_bn == b->rp_bn;
+}
+
+
+/* order of a section's first blocks: VOL1, then HDR labels, then the rest */
+static int rp_rank(replica_t *rp)
+{
+	if (rp->rp_kind != RK_LABEL)
+		return 2;
+	if (memcmp(rp->rp_label, "VOL", 3) == 0)
+		return 0;
+	return memcmp(rp->rp_label, "HDR", 3) == 0 ? 1 : 2;
+}
+
+
+/* among valid copies of sel's block, pick the one most others agree with */
+static replica_t *rp_vote(replica_t *rp, int nrp, replica_t *sel)
+{
+	replica_t *best = sel;
+	int i, j, n, max = 0;
+
+	for (i = 0; i < nrp; i++) {
+		if (!rp_same(&rp[i], sel))
+			continue;
+		for (n = 0, j = 0; j < nrp; j++)
+			if (rp_same(&rp[j], sel) &&
+			    rp[j].rp_nbytes == rp[i].rp_nbytes &&
+			    memcmp(rp[j].rp_buf, rp[i].rp_buf,
+				   rp[i].rp_nbytes) == 0)
+				n++;
+		if (n > max) {
+			max = n;
+			best = &rp[i];
+		}
+	}
+
+	if (verbose && sel->rp_kind == RK_DATA) {
+		for (n = 0, i = 0; i < nrp; i++)
+			n += rp_same(&rp[i], sel);
+		if (max < n)
+			fprintf(stderr, "%s: block %d differs between "
+					"replicas, %d of %d agree\n",
+				best->rp_tap->tp_path, sel->rp_bn, max, n);
+	}
+	return best;
+}
+
+
+/*
+ * Read replicas in lockstep and write the best copy of each block to ot.
+ * Blocks are matched by kind and, for data, by the block number in the
+ * I-format trailer, so a replica that lost blocks waits for the others
+ * to catch up.  A replica whose copy fails validation just moves on.
+ * Data blocks are lost far more often than tapemarks and labels, so a
+ * replica's pending data block goes before another's tapemark or label.
+ * If the next data block in sequence has only damaged copies, the first
+ * of them is written in its place.
+ * returns 0 if every block had a valid copy, else 2
+ */
+int merge_replicas(TAPE **taps, int ntap, TAPE *ot)
+{
+	replica_t *rp, *sel, cur;
+	unsigned long nblk = 0, nbad = 0;
+	int i, expect = -1, standin;
+
+	rp = calloc(ntap, sizeof(replica_t));
+	if (!rp) {
+		fprintf(stderr, "merge_replicas: out of memory\n");
+		return 2;
+	}
+	for (i = 0; i < ntap; i++) {
+		rp[i].rp_tap = taps[i];
+		rp_next(&rp[i]);
+	}
+
+	while (1) {
+		sel = NULL;
+		standin = 0;
+
+		/* pass over copies of data blocks already written */
+		for (i = 0; i < ntap; i++)
+			while (rp[i].rp_kind == RK_DATA && rp[i].rp_bn < expect)
+				rp_next(&rp[i]);
+
+		/* next data block in sequence */
+		for (i = 0; i < ntap && !sel; i++)
+			if (rp[i].rp_kind == RK_DATA && rp[i].rp_bn == expect)
+				sel = &rp[i];
+
+		/* no valid copy of it: a damaged one stands in */
+		for (i = 0; i < ntap && !sel && expect >= 0; i++)
+			if (rp[i].rp_kind == RK_BAD) {
+				sel = &rp[i];
+				standin = 1;
+			}
+
+		/* out of sequence: lowest-numbered data block */
+		if (!sel)
+			for (i = 0; i < ntap; i++)
+				if (rp[i].rp_kind == RK_DATA &&
+				    (!sel || rp[i].rp_bn < sel->rp_bn))
+					sel = &rp[i];
+
+		/* tapemark or label; one that others lack comes first */
+		if (!sel)
+			for (i = 0; i < ntap; i++)
+				if ((rp[i].rp_kind == RK_MARK ||
+				     rp[i].rp_kind == RK_LABEL) &&
+				    (!sel || rp_rank(&rp[i]) < rp_rank(sel)))
+					sel = &rp[i];
+
+		/* no good copy: keep the first bad one */
+		for (i = 0; i < ntap && !sel; i++)
+			if (rp[i].rp_kind == RK_BAD)
+				sel = &rp[i];
+
+		if (!sel)
+			break;
+		if (sel->rp_kind == RK_BAD) {
+			fprintf(stderr, "%s: no valid copy of block "
+					"at offset 0x%lx\n",
+				sel->rp_tap->tp_path,
+				(long)sel->rp_tap->tp_boff);
+			nbad++;
+		}
+
+		if (sel->rp_kind != RK_BAD)
+			sel = rp_vote(rp, ntap, sel);
+		dprint(("merge_replicas: block %lu from %s kind %d bn %d\n",
+			nblk, sel->rp_tap->tp_path, sel->rp_kind,
+			sel->rp_bn));
+		(void) tap_writeblock(ot, sel->rp_buf, sel->rp_nbytes);
+		sel->rp_used++;
+		nblk++;
+
+		/* a stand-in leaves the others where they are, past it */
+		if (standin) {
+			for (i = 0; i < ntap; i++)
+				if (rp[i].rp_kind == RK_BAD)
+					rp_next(&rp[i]);
+			expect++;
+			continue;
+		}
+
+		/* block numbering restarts after HDR1, so don't assume it */
+		/* carries on past a tapemark or label */
+		expect = sel->rp_kind == RK_DATA ? sel->rp_bn + 1 : -1;
+
+		/* advance past this block, and bad copies in its place */
+		cur = *sel;
+		for (i = 0; i < ntap; i++)
+			if (rp_same(&rp[i], &cur) || rp[i].rp_kind == RK_BAD)
+				rp_next(&rp[i]);
+	}
+
+	if (verbose) {
+		for (i = 0; i < ntap; i++)
+			fprintf(stderr, "%s: %lu blocks used\n",
+				rp[i].rp_tap->tp_path, rp[i].rp_used);
+		fprintf(stderr, "%lu blocks written, %lu without a valid "
+				"copy\n", nblk, nbad);
+	}
+
+	free(rp);
+	return nbad ? 2 : 0;
+}
@@ -19,11 +19,25 @@
  * Routines for reading/writing SIMH-format tape images.
  */
 
+#define _GNU_SOURCE	/* for O_DIRECT */
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include "ansi.h"
+#include "blkstore.h"
 #include "cdctap.h"
 #include "simtap.h"
 
@@ -32,16 +46,382 @@
 
 /* tp_status bits */
 #define	TP_WRITE	0x1
+#define	TP_NOSEEK	0x2	/* pipe, device or compressed image */
+#define	TP_MEM		0x4	/* image in memory, no file */
 #define	TP_ERR		0x40
 #define	TP_EOM		0x80
 
+/* read-ahead chunk size */
+#define RA_CHUNK	(256*1024)
+
+/* I/O policy hints are applied per window of this many bytes */
+#define IO_WINDOW	(8*1024*1024)
+
+/* output is collected into blocks of this size, then written */
+#define WBUF_SIZE	(1024*1024)
+
+/* how often to look for more data when following a growing image */
+#define FOLLOW_POLL	200000	/* usec */
+
+/* default read-ahead for pipes, to decouple us from the writer */
+#define PIPE_QDEPTH	32
+
+/* read-ahead queue depth in chunks; 0=read synchronously */
+int tap_qdepth = 0;
+
+/* page cache policy for reading, TAP_IO_xxx */
+int tap_iopolicy = TAP_IO_DEFAULT;
+
+/* larger blocks are skipped rather than read into memory */
+uint32_t tap_maxblock = 1024*1024;
+
+/* preallocate images being written, IO_WINDOW at a time */
+int tap_prealloc = 0;
+
+/* wait up to this many seconds for a regular file to grow; 0=don't */
+int tap_follow = 0;
+
+/* if set, resynchronize after a bad block on blocks this accepts */
+int (*tap_recover)(char *buf, int nbytes) = NULL;
+
+/*
+ * Read-ahead state: a helper thread fills a ring of ra_depth chunks
+ * while the consumer unpacks blocks from the oldest one.
+ */
+struct tap_ra {
+	pthread_t	ra_thread;
+	pthread_mutex_t	ra_lock;
+	pthread_cond_t	ra_cond;
+	int		ra_fd;
+	int		ra_depth;
+	char		**ra_buf;	/* ring of chunks */
+	ssize_t		*ra_len;	/* bytes in chunk, 0=EOF, -1=error */
+	int		ra_head;	/* next chunk to fill */
+	int		ra_tail;	/* chunk being consumed */
+	int		ra_count;	/* chunks filled, including tail */
+	int		ra_done;	/* producer saw EOF or error */
+	int		ra_stop;	/* consumer wants producer to exit */
+	int		ra_wake[2];	/* pipe to wake producer from poll */
+	size_t		ra_pos;		/* bytes consumed from tail chunk */
+	unsigned long	ra_nchunk;	/* chunks consumed */
+	unsigned long	ra_stalls;	/* times consumer found ring empty */
+};
+
+
+static void *ra_thread(void *arg)
+{
+	struct tap_ra *ra = arg;
+	struct pollfd pfd[2];
+	ssize_t n, rv;
+	char *bp;
+
+	pfd[0].fd = ra->ra_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ra->ra_wake[0];
+	pfd[1].events = POLLIN;
+
+	while (1) {
+		/* wait for a free chunk */
+		pthread_mutex_lock(&ra->ra_lock);
+		while (ra->ra_count == ra->ra_depth && !ra->ra_stop)
+			pthread_cond_wait(&ra->ra_cond, &ra->ra_lock);
+		bp = ra->ra_buf[ra->ra_head];
+		n = ra->ra_stop;
+		pthread_mutex_unlock(&ra->ra_lock);
+		if (n)
+			break;
+
+		/* fill it; a pipe may stall, so don't block in read */
+		for (n = 0; n < RA_CHUNK; n += rv) {
+			rv = poll(pfd, 2, -1);
+			if (rv < 0 && errno == EINTR) {
+				rv = 0;
+				continue;
+			}
+			if (rv < 0)
+				break;
+			if (pfd[1].revents)
+				return NULL;
+			rv = read(ra->ra_fd, bp + n, RA_CHUNK - n);
+			if (rv < 0 && errno == EINTR) {
+				rv = 0;
+				continue;
+			}
+			if (rv <= 0)
+				break;
+		}
+		if (rv < 0 && n == 0)
+			n = -1;
+
+		/* hand it to consumer */
+		pthread_mutex_lock(&ra->ra_lock);
+		ra->ra_len[ra->ra_head] = n;
+		ra->ra_head = (ra->ra_head + 1) % ra->ra_depth;
+		ra->ra_count++;
+		if (n < RA_CHUNK)
+			ra->ra_done = 1;
+		pthread_cond_broadcast(&ra->ra_cond);
+		pthread_mutex_unlock(&ra->ra_lock);
+		if (n < RA_CHUNK)
+			break;
+	}
+	return NULL;
+}
+
+
+/* start read-ahead thread on fd; returns NULL if not possible */
+static struct tap_ra *ra_start(int fd, int depth)
+{
+	struct tap_ra *ra;
+	int i;
+
+	if (depth < 2)
+		depth = 2;
+	ra = calloc(1, sizeof(struct tap_ra));
+	if (!ra)
+		return NULL;
+	ra->ra_buf = calloc(depth, sizeof(char *));
+	ra->ra_len = calloc(depth, sizeof(ssize_t));
+	if (!ra->ra_buf || !ra->ra_len)
+		goto fail;
+	for (i = 0; i < depth; i++)
+		/* aligned, in case of O_DIRECT */
+		if (posix_memalign((void **)&ra->ra_buf[i], 4096, RA_CHUNK))
+			goto fail;
+	if (pipe(ra->ra_wake) < 0)
+		goto fail;
+	ra->ra_fd = fd;
+	ra->ra_depth = depth;
+	pthread_mutex_init(&ra->ra_lock, NULL);
+	pthread_cond_init(&ra->ra_cond, NULL);
+	if (pthread_create(&ra->ra_thread, NULL, ra_thread, ra) == 0)
+		return ra;
+	pthread_cond_destroy(&ra->ra_cond);
+	pthread_mutex_destroy(&ra->ra_lock);
+	close(ra->ra_wake[0]);
+	close(ra->ra_wake[1]);
+
+    fail:
+	if (ra->ra_buf)
+		for (i = 0; i < depth; i++)
+			free(ra->ra_buf[i]);
+	free(ra->ra_buf);
+	free(ra->ra_len);
+	free(ra);
+	return NULL;
+}
+
+
+static void ra_stop(struct tap_ra *ra)
+{
+	int i;
+
+	/* producer may be waiting for input or for a free chunk */
+	pthread_mutex_lock(&ra->ra_lock);
+	ra->ra_stop = 1;
+	pthread_cond_broadcast(&ra->ra_cond);
+	pthread_mutex_unlock(&ra->ra_lock);
+	if (write(ra->ra_wake[1], "", 1) < 0)
+		perror("ra_stop");
+	pthread_join(ra->ra_thread, NULL);
+
+	pthread_cond_destroy(&ra->ra_cond);
+	pthread_mutex_destroy(&ra->ra_lock);
+	close(ra->ra_wake[0]);
+	close(ra->ra_wake[1]);
+	for (i = 0; i < ra->ra_depth; i++)
+		free(ra->ra_buf[i]);
+	free(ra->ra_buf);
+	free(ra->ra_len);
+	free(ra);
+}
+
+
+/* copy n bytes from read-ahead ring to dst */
+/* returns number of bytes copied, less than n at EOF or error */
+static size_t ra_read(struct tap_ra *ra, unsigned char *dst, size_t n)
+{
+	size_t nc, rv = 0;
+	ssize_t len;
+
+	while (rv < n) {
+		/* wait for a chunk if ring is empty */
+		pthread_mutex_lock(&ra->ra_lock);
+		if (ra->ra_count == 0)
+			ra->ra_stalls++;
+		while (ra->ra_count == 0)
+			pthread_cond_wait(&ra->ra_cond, &ra->ra_lock);
+		len = ra->ra_len[ra->ra_tail];
+		pthread_mutex_unlock(&ra->ra_lock);
+
+		if (len <= 0)
+			break;
+
+		nc = MIN(n - rv, len - ra->ra_pos);
+		memcpy(dst + rv, ra->ra_buf[ra->ra_tail] + ra->ra_pos, nc);
+		ra->ra_pos += nc;
+		rv += nc;
+
+		/* release exhausted chunk, unless it is the final one */
+		if (ra->ra_pos == len && len == RA_CHUNK) {
+			pthread_mutex_lock(&ra->ra_lock);
+			ra->ra_tail = (ra->ra_tail + 1) % ra->ra_depth;
+			ra->ra_count--;
+			ra->ra_pos = 0;
+			ra->ra_nchunk++;
+			pthread_cond_broadcast(&ra->ra_cond);
+			pthread_mutex_unlock(&ra->ra_lock);
+		} else if (ra->ra_pos == len)
+			break;
+	}
+	return rv;
+}
+
+
+/* compressed image formats, recognized by magic number */
+static struct ztab {
+	char	*z_magic;
+	int	z_len;
+	char	*z_prog;
+} ztab[] = {
+    { "\037\213",			2, "gzip" },
+    { "\050\265\057\375",		4, "zstd" },
+    { "\3757zXZ\0",			6, "xz" },
+    { "BZh",				3, "bzip2" },
+    { NULL,				0, NULL }
+};
+
+
+/* return read end of a pipe fed with buf[0..n-1] and then fd */
+/* by a child process, whose pid is returned in *pidp */
+static int tap_feed(int fd, char *buf, int n, pid_t *pidp)
+{
+	int pfd[2];
+	ssize_t rv;
+	char cbuf[65536];
+
+	if (pipe(pfd) < 0)
+		return -1;
+	switch (*pidp = fork()) {
+	    case -1:
+		*pidp = 0;
+		close(pfd[0]);
+		close(pfd[1]);
+		return -1;
+
+	    case 0:
+		close(pfd[0]);
+		if (write(pfd[1], buf, n) != n)
+			_exit(1);
+		while ((rv = read(fd, cbuf, sizeof cbuf)) > 0)
+			if (write(pfd[1], cbuf, rv) != rv)
+				_exit(1);
+		_exit(rv < 0);
+	}
+	close(pfd[1]);
+	return pfd[0];
+}
+
+
+/* if image is compressed, return pipe from decompressor, else fp */
+/* bytes read from a non-seekable fp to check are returned in pre */
+/* pids of the decompressor and any process feeding it go in pidp[0..1] */
+/* returns NULL if decompressor can't be started */
+static FILE *tap_unzip(FILE *fp, char *path, pid_t *pidp,
+		       char *pre, int *npre)
+{
+	struct ztab *zp;
+	char magic[6];
+	int fd = fileno(fp);
+	int pfd[2];
+	ssize_t n, rv;
+	int seekable = 1;
+
+	pidp[0] = pidp[1] = 0;
+	*npre = 0;
+	n = pread(fd, magic, sizeof magic, 0);
+	if (n < 0 && errno == ESPIPE) {
+		/* pipe: we'll have to put these bytes back */
+		seekable = 0;
+		for (n = 0; n < sizeof magic; n += rv) {
+			rv = read(fd, magic + n, sizeof magic - n);
+			if (rv <= 0)
+				break;
+		}
+	}
+	for (zp = ztab; zp->z_magic; zp++)
+		if (n >= zp->z_len && memcmp(magic, zp->z_magic, zp->z_len) == 0)
+			break;
+	if (!zp->z_magic) {
+		if (!seekable) {
+			memcpy(pre, magic, n);
+			*npre = n;
+		}
+		return fp;
+	}
+
+	dprint(("%s: tap_unzip: %s-compressed\n", path, zp->z_prog));
+
+	/* a pipe's bytes already read go back in front of the rest */
+	if (seekable)
+		lseek(fd, 0, SEEK_SET);
+	else if ((fd = tap_feed(fd, magic, n, &pidp[1])) < 0) {
+		perror("tap_feed");
+		fclose(fp);
+		return NULL;
+	}
+
+	if (pipe(pfd) < 0) {
+		perror("pipe");
+		fclose(fp);
+		if (pidp[1])
+			close(fd);
+		return NULL;
+	}
+	switch (pidp[0] = fork()) {
+	    case -1:
+		perror("fork");
+		close(pfd[0]);
+		close(pfd[1]);
+		fclose(fp);
+		if (pidp[1])
+			close(fd);
+		return NULL;
+
+	    case 0:
+		/* child: decompress image to pipe */
+		dup2(fd, 0);
+		dup2(pfd[1], 1);
+		close(pfd[0]);
+		close(pfd[1]);
+		if (fd != 0)
+			close(fd);
+		execlp(zp->z_prog, zp->z_prog, "-dc", (char *)NULL);
+		fprintf(stderr, "%s: ", path);
+		perror(zp->z_prog);
+		_exit(127);
+	}
+
+	close(pfd[1]);
+	fclose(fp);
+	if (pidp[1])
+		close(fd);
+	fp = fdopen(pfd[0], "r");
+	if (!fp)
+		close(pfd[0]);
+	return fp;
+}
+
 
 /* read if fname=NULL, else write w/actual file name returned in fname */
 TAPE *tap_open(char *path, char *fname)
 {
 	FILE *fp;
 	TAPE *rv;
-	int i;
+	struct stat st;
+	pid_t pid[2] = { 0, 0 };
+	char pre[6];
+	int i, fl, npre = 0, direct = 0;
 
 	if (fname) {
 		sprintf(fname, "%s.tap", path);
@@ -58,7 +438,9 @@ TAPE *tap_open(char *path, char *fname)
 			sprintf(fname, "%s.%d.tap", path, i+1);
 		}
 	} else {
-		fp = fopen(path, "r");
+		fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+		if (fp)
+			fp = tap_unzip(fp, path, pid, pre, &npre);
 	}
 
 	if (!fp)
@@ -66,22 +448,296 @@ TAPE *tap_open(char *path, char *fname)
 
 	rv = (TAPE *)malloc(sizeof(TAPE));
 	if (rv) {
+		memset(rv, 0, sizeof(TAPE));
 		rv->tp_fp = fp;
 		rv->tp_path = fname ? fname : path;
-		rv->tp_buf = NULL;
-		rv->tp_nbytes = 0;
 		rv->tp_status = fname ? TP_WRITE : 0;
+		rv->tp_pid = pid[0];
+		rv->tp_fpid = pid[1];
+		memcpy(rv->tp_pre, pre, npre);
+		rv->tp_npre = npre;
+	}
+
+	/* writes are collected in tp_wbuf and written with pwrite */
+	if (rv && fname) {
+		rv->tp_wbuf = malloc(WBUF_SIZE);
+		rv->tp_wsize = WBUF_SIZE;
+		if (!rv->tp_wbuf) {
+			fprintf(stderr, "%s: no memory for output buffer\n",
+				fname);
+			fclose(fp);
+			free(rv);
+			return NULL;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &rv->tp_start);
+	}
+
+	if (!rv || fname)
+		return rv;
+
+	if (pid[0] || fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode))
+		rv->tp_status |= TP_NOSEEK;
+	else
+		rv->tp_size = st.st_size;
+
+	/* list of an image in a block store: read blocks from there */
+	if (!(rv->tp_status & TP_NOSEEK) && bs_is_list(fileno(fp))) {
+		rv->tp_bs = bs_open(fp, path, &rv->tp_size);
+		fclose(fp);
+		rv->tp_fp = NULL;
+		if (!rv->tp_bs) {
+			free(rv);
+			return NULL;
+		}
+		return rv;
+	}
+
+	/* O_DIRECT needs aligned buffers, so it implies read-ahead */
+	if (tap_iopolicy == TAP_IO_DIRECT && !pid[0] && !tap_follow) {
+		fl = fcntl(fileno(fp), F_GETFL);
+		if (fcntl(fileno(fp), F_SETFL, fl | O_DIRECT) == 0)
+			direct = 1;
+		else
+			fprintf(stderr, "%s: O_DIRECT not supported, "
+					"using page cache\n", path);
+	}
+	if (tap_iopolicy == TAP_IO_SEQ || tap_iopolicy == TAP_IO_DROP)
+		(void) posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	/*
+	 * Map regular files for reading so tap_readblock can return
+	 * blocks in place. Fall back to stdio if the map fails.
+	 * An image that is still growing is read with stdio.
+	 */
+	if (tap_qdepth == 0 && !direct && !tap_follow &&
+	    !(rv->tp_status & TP_NOSEEK) && st.st_size > 0) {
+		rv->tp_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+				  fileno(fp), 0);
+		if (rv->tp_map == MAP_FAILED) {
+			dprint(("%s: tap_open: mmap failed, using stdio\n",
+				path));
+			rv->tp_map = NULL;
+		} else {
+			rv->tp_mapsize = st.st_size;
+			(void) madvise(rv->tp_map, st.st_size,
+				       MADV_SEQUENTIAL);
+		}
+	}
+
+	/* otherwise, read ahead of the consumer if requested */
+	/* pipes always get a deep queue, so the writer rarely blocks */
+	if (!rv->tp_map && (rv->tp_status & TP_NOSEEK ||
+			    !tap_follow && (tap_qdepth > 0 || direct))) {
+		rv->tp_ra = ra_start(fileno(fp), tap_qdepth ? tap_qdepth
+				     : (rv->tp_status & TP_NOSEEK) ? PIPE_QDEPTH
+				     : 0);
+		if (!rv->tp_ra)
+			fprintf(stderr, "%s: read-ahead not available\n",
+				path);
 	}
 
 	return rv;
 }
 
 
-void tap_close(TAPE *tap)
+/*
+ * Open an image held in memory: read len bytes at buf (which must stay
+ * valid until tap_close), or write a growing buffer if buf is NULL.
+ * name is used in messages.
+ */
+TAPE *tap_memopen(char *buf, size_t len, char *name)
+{
+	TAPE *rv;
+
+	rv = (TAPE *)calloc(1, sizeof(TAPE));
+	if (!rv)
+		return NULL;
+	rv->tp_path = name;
+	rv->tp_status = TP_MEM;
+
+	if (buf) {
+		/* read as if mapped */
+		rv->tp_map = buf;
+		rv->tp_mapsize = rv->tp_size = len;
+		return rv;
+	}
+
+	rv->tp_status |= TP_WRITE;
+	rv->tp_wsize = WBUF_SIZE;
+	rv->tp_wbuf = malloc(rv->tp_wsize);
+	if (!rv->tp_wbuf) {
+		free(rv);
+		return NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &rv->tp_start);
+	return rv;
+}
+
+
+/* Take the image written so far to an in-memory tape; caller frees it */
+/* returns NULL if tap isn't in memory */
+char *tap_membuf(TAPE *tap, size_t *lenp)
+{
+	char *rv = tap->tp_wbuf;
+
+	if ((tap->tp_status & (TP_MEM | TP_WRITE)) != (TP_MEM | TP_WRITE))
+		return NULL;
+
+	*lenp = tap->tp_wlen;
+	tap->tp_wbuf = NULL;
+	tap->tp_wlen = tap->tp_wsize = 0;
+	return rv;
+}
+
+
+/* write iov at tp_off, preallocating ahead of it if requested */
+/* returns -1 if error */
+static int tap_pwritev(TAPE *tap, struct iovec *iov, int cnt)
+{
+	int fd = fileno(tap->tp_fp);
+	ssize_t rv;
+	size_t len;
+	int i;
+
+	for (len = 0, i = 0; i < cnt; i++) {
+		len += iov[i].iov_len;
+		if (tap->tp_hash)
+			hash_update(tap->tp_hash, iov[i].iov_base,
+				    iov[i].iov_len);
+	}
+	if (tap_prealloc && tap->tp_alloc >= 0 &&
+	    tap->tp_off + len > tap->tp_alloc) {
+		len = (tap->tp_off + len - tap->tp_alloc + IO_WINDOW - 1)
+		      / IO_WINDOW * IO_WINDOW;
+		if (fallocate(fd, FALLOC_FL_KEEP_SIZE, tap->tp_alloc, len) == 0)
+			tap->tp_alloc += len;
+		else
+			tap->tp_alloc = -1;
+	}
+
+	while (cnt > 0) {
+		rv = pwritev(fd, iov, cnt, tap->tp_off);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(tap->tp_path);
+			tap->tp_status |= TP_ERR;
+			return -1;
+		}
+		tap->tp_off += rv;
+
+		/* short write: skip what was written */
+		for ( ; cnt > 0 && rv >= iov->iov_len; iov++, cnt--)
+			rv -= iov->iov_len;
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + rv;
+			iov->iov_len -= rv;
+		}
+	}
+	return 0;
+}
+
+
+/* write out buffered blocks */
+/* returns -1 if error */
+static int tap_flush(TAPE *tap)
+{
+	struct iovec iov;
+
+	iov.iov_base = tap->tp_wbuf;
+	iov.iov_len = tap->tp_wlen;
+	tap->tp_wlen = 0;
+	return tap_pwritev(tap, &iov, 1);
+}
+
+
+/* flush, trim preallocation and report throughput of image written */
+static void tap_wclose(TAPE *tap)
+{
+	struct timespec now;
+	double secs;
+
+	if (tap->tp_status & TP_MEM) {
+		free(tap->tp_wbuf);
+		return;
+	}
+
+	(void) tap_flush(tap);
+	if (tap->tp_alloc > tap->tp_off &&
+	    ftruncate(fileno(tap->tp_fp), tap->tp_off) < 0)
+		perror(tap->tp_path);
+
+	if (verbose > 1) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		secs = now.tv_sec - tap->tp_start.tv_sec +
+		       (now.tv_nsec - tap->tp_start.tv_nsec) / 1e9;
+		fprintf(stderr, "%s: wrote %lu blocks, %ld bytes "
+				"in %.3f sec, %.1f MB/s\n",
+			tap->tp_path, tap->tp_nblocks, (long)tap->tp_off,
+			secs, secs > 0 ? tap->tp_off / secs / 1e6 : 0.0);
+	}
+	free(tap->tp_wbuf);
+}
+
+
+/* wait for the decompressor and its feeder, if any */
+/* returns -1 if either failed */
+static int tap_reap(TAPE *tap)
+{
+	pid_t pid[2];
+	int i, status, rv = 0;
+
+	pid[0] = tap->tp_pid;
+	pid[1] = tap->tp_fpid;
+	tap->tp_pid = tap->tp_fpid = 0;
+	for (i = 0; i < 2; i++) {
+		if (!pid[i])
+			continue;
+		/* decompressor's gone: feeder may be stuck reading stdin */
+		if (i == 1)
+			(void) kill(pid[i], SIGPIPE);
+		if (waitpid(pid[i], &status, 0) != pid[i])
+			continue;
+
+		/* SIGPIPE just means we stopped reading early */
+		if (WIFEXITED(status) && WEXITSTATUS(status) != 0 ||
+		    WIFSIGNALED(status) && WTERMSIG(status) != SIGPIPE)
+			rv = -1;
+	}
+	if (rv < 0)
+		fprintf(stderr, "%s: decompression failed\n", tap->tp_path);
+	return rv;
+}
+
+
+/* release everything tap_open acquired except tap itself */
+static void tap_release(TAPE *tap)
 {
-	fclose(tap->tp_fp);
+	if (tap->tp_status & TP_WRITE)
+		tap_wclose(tap);
+
+	if (tap->tp_ra) {
+		if (verbose > 1)
+			fprintf(stderr, "%s: read-ahead depth %d: "
+					"%lu chunks, %lu stalls\n",
+				tap->tp_path, tap->tp_ra->ra_depth,
+				tap->tp_ra->ra_nchunk, tap->tp_ra->ra_stalls);
+		ra_stop(tap->tp_ra);
+	}
+	if (tap->tp_fp)
+		fclose(tap->tp_fp);
+	(void) tap_reap(tap);
+	if (tap->tp_map && !(tap->tp_status & TP_MEM))
+		munmap(tap->tp_map, tap->tp_mapsize);
+	bs_close(tap->tp_bs);
 	if (tap->tp_buf)
 		free(tap->tp_buf);
+}
+
+
+void tap_close(TAPE *tap)
+{
+	tap_release(tap);
 	memset(tap, 0, sizeof(TAPE));
 	free(tap);
 }
@@ -93,21 +749,342 @@ int tap_is_write(TAPE *tap)
 }
 
 
-/* Read next tape block */
-/* returns block size, -1=end of tape, -2=error, e.g. out of memory */
-ssize_t tap_readblock(TAPE *tap, char **bufp)
+/* after this image, read vols (NULL-terminated) as one logical tape */
+void tap_setvols(TAPE *tap, char **vols)
 {
-	unsigned char sbuf[4];
-	ssize_t rv;
+	tap->tp_vols = vols;
+}
 
-	*bufp = NULL;
 
-	if (tap->tp_status & TP_WRITE) {
-		fprintf(stderr,
-			"%s: tap_readblock not allowed while writing tape",
-			tap->tp_path);
-		return -2;
+/* current byte offset in tape image */
+off_t tap_tell(TAPE *tap)
+{
+	return tap->tp_off;
+}
+
+
+/* apply I/O policy as the read cursor advances */
+static void tap_advise(TAPE *tap)
+{
+	off_t off = tap->tp_off / IO_WINDOW * IO_WINDOW;
+	off_t len;
+	int fd = fileno(tap->tp_fp);
+
+	if (off <= tap->tp_advised)
+		return;
+
+	switch (tap_iopolicy) {
+	    case TAP_IO_DROP:
+		/* release pages behind the cursor */
+		if (tap->tp_map)
+			(void) madvise(tap->tp_map + tap->tp_advised,
+				       off - tap->tp_advised, MADV_DONTNEED);
+		(void) posix_fadvise(fd, tap->tp_advised,
+				     off - tap->tp_advised, POSIX_FADV_DONTNEED);
+		/* fall through */
+
+	    case TAP_IO_SEQ:
+		/* ask for the window after the current one */
+		if (tap->tp_map) {
+			len = MIN(IO_WINDOW, tap->tp_mapsize - off - IO_WINDOW);
+			if (len > 0)
+				(void) madvise(tap->tp_map + off + IO_WINDOW,
+					       len, MADV_WILLNEED);
+		} else if (!tap->tp_ra)
+			(void) posix_fadvise(fd, off + IO_WINDOW, IO_WINDOW,
+					     POSIX_FADV_WILLNEED);
+		break;
 	}
+	tap->tp_advised = off;
+}
+
+
+/* read n bytes, in follow mode waiting for the image to grow if need be */
+static size_t tap_fread(TAPE *tap, unsigned char *dst, size_t n)
+{
+	size_t nc, got = 0;
+	time_t last = time(NULL);
+
+	while (1) {
+		nc = fread(dst + got, 1, n - got, tap->tp_fp);
+		got += nc;
+		if (got == n || !tap_follow || ferror(tap->tp_fp))
+			break;
+
+		/* partial block: writer hasn't caught up yet */
+		if (nc)
+			last = time(NULL);
+		else if (time(NULL) - last >= tap_follow)
+			break;
+		clearerr(tap->tp_fp);
+		usleep(FOLLOW_POLL);
+	}
+	return got;
+}
+
+
+/* get next n bytes from image, via dst if not mapped */
+/* returns NULL if fewer than n bytes remain */
+static unsigned char *tap_get(TAPE *tap, unsigned char *dst, size_t n)
+{
+	unsigned char *rv;
+	size_t got;
+
+	if (tap->tp_map) {
+		if (tap->tp_mapsize - tap->tp_off < n) {
+			tap->tp_off = tap->tp_mapsize;
+			return NULL;
+		}
+		rv = (unsigned char *)tap->tp_map + tap->tp_off;
+		tap->tp_off += n;
+		return rv;
+	}
+
+	if (tap->tp_bs) {
+		rv = bs_get(tap->tp_bs, tap->tp_off, dst, n);
+		tap->tp_off = rv ? tap->tp_off + n : tap->tp_size;
+		return rv;
+	}
+
+	/* bytes read by tap_unzip come first */
+	got = MIN(n, tap->tp_npre);
+	if (got) {
+		memcpy(dst, tap->tp_pre, got);
+		tap->tp_npre -= got;
+		memmove(tap->tp_pre, tap->tp_pre + got, tap->tp_npre);
+	}
+
+	if (tap->tp_ra)
+		got += ra_read(tap->tp_ra, dst + got, n - got);
+	else
+		got += tap_fread(tap, dst + got, n - got);
+	tap->tp_off += got;
+	return got == n ? dst : NULL;
+}
+
+
+/* skip over next n bytes of image without buffering them */
+/* returns -1 if fewer than n bytes remain */
+static int tap_skip(TAPE *tap, off_t n)
+{
+	unsigned char scratch[16384];
+	size_t nc;
+
+	if (tap->tp_map) {
+		if (tap->tp_mapsize - tap->tp_off < n) {
+			tap->tp_off = tap->tp_mapsize;
+			return -1;
+		}
+		tap->tp_off += n;
+		return 0;
+	}
+
+	/* block store, or regular file read synchronously: just seek */
+	if (tap->tp_bs || !(tap->tp_status & TP_NOSEEK) && !tap->tp_ra &&
+	    !tap->tp_npre && !tap_follow) {
+		if (tap->tp_size - tap->tp_off < n || !tap->tp_bs &&
+		    fseeko(tap->tp_fp, n, SEEK_CUR) < 0) {
+			tap->tp_off = tap->tp_size;
+			return -1;
+		}
+		tap->tp_off += n;
+		return 0;
+	}
+
+	for ( ; n > 0; n -= nc) {
+		nc = MIN(n, sizeof scratch);
+		if (!tap_get(tap, scratch, nc))
+			return -1;
+	}
+	return 0;
+}
+
+
+/* return n bytes just read, starting at offset off, to be read again */
+static void tap_unget(TAPE *tap, unsigned char *bp, int n, off_t off)
+{
+	if (!tap->tp_map && !tap->tp_bs) {
+		memmove(tap->tp_pre + n, tap->tp_pre, tap->tp_npre);
+		memcpy(tap->tp_pre, bp, n);
+		tap->tp_npre += n;
+	}
+	tap->tp_off = off;
+}
+
+
+/*
+ * Look at next block without reading past it, unless consume is set
+ * and the block is a tapemark or label.
+ * returns 0=tapemark, 1=label (copied to lbuf), -1=anything else
+ */
+static int tap_peek(TAPE *tap, char *lbuf, int consume)
+{
+	unsigned char pk[88], *bp;
+	off_t off = tap->tp_off;
+	int rv = -1, n = 4;
+
+	/* a stream's short read leaves what it did get in pk */
+	bp = tap_get(tap, pk, 4);
+	if (!bp) {
+		tap_unget(tap, pk, tap->tp_off - off, off);
+		return -1;
+	}
+	memmove(pk, bp, 4);
+
+	if (LE32(pk) == 0)
+		rv = 0;
+	else if (LE32(pk) == 80) {
+		bp = tap_get(tap, pk + 4, 84);
+		if (bp) {
+			memmove(pk + 4, bp, 84);
+			n = 88;
+			if (LE32(pk + 84) == 80 &&
+			    is_label((char *)pk + 4, 80, lbuf))
+				rv = 1;
+		} else
+			n = tap->tp_off - off;
+	}
+
+	if (rv < 0 || !consume)
+		tap_unget(tap, pk, n, off);
+	return rv;
+}
+
+
+/* look at next block without reading it, even on a stream */
+/* returns 0=tapemark, 1=label (copied to lbuf), -1=anything else */
+int tap_peekblock(TAPE *tap, char *lbuf)
+{
+	return tap_peek(tap, lbuf, 0);
+}
+
+
+/*
+ * Switch to the next volume of a set, skipping the volume and header
+ * labels and tapemark that precede the continued data.
+ * returns 0 if there are no more volumes, -1 if the next can't be opened
+ */
+static int tap_nextvol(TAPE *tap)
+{
+	TAPE *nt;
+	char **vols = tap->tp_vols;
+	char lbuf[81];
+
+	if (!vols || !*vols)
+		return 0;
+
+	nt = tap_open(*vols, NULL);
+	if (!nt) {
+		perror(*vols);
+		tap->tp_vols = NULL;
+		tap->tp_status |= TP_ERR;
+		return -1;
+	}
+	if (verbose)
+		fprintf(stderr, "%s: continuing on %s\n",
+			tap->tp_path, nt->tp_path);
+
+	nt->tp_volno = tap->tp_volno + 1;
+	tap_release(tap);
+	*tap = *nt;
+	free(nt);
+	tap->tp_vols = vols + 1;
+
+	while (tap_peek(tap, lbuf, 1) > 0)
+		;
+	return 1;
+}
+
+
+/* size of consistent header/data/trailer at p, acceptable to accept */
+/* (any consistent block if accept is NULL) */
+/* returns 0 if not a plausible block */
+static size_t tap_plausible(unsigned char *p, unsigned char *end,
+			    int (*accept)(char *, int))
+{
+	uint32_t n = LE32(p);
+	unsigned char *tp;
+
+	/* cheap tests first: nearly every offset fails here */
+	if (n == 0 || tap_maxblock && n > tap_maxblock ||
+	    (size_t)(end - p) < (size_t)n + 8)
+		return 0;
+	tp = p + 4 + n;
+	if (LE32(tp) != n) {
+		if (!(n & 1) || end - tp < 5 || LE32(tp+1) != n)
+			return 0;
+		tp++;		/* padded */
+	}
+	if (accept && !accept((char *)p + 4, n))
+		return 0;
+
+	return tp + 4 - p;
+}
+
+
+/*
+ * Scan mapped image forward from off for the next plausible block that
+ * is followed by a tapemark, end of medium, or another plausible block.
+ * returns its offset, -1 if nothing found
+ */
+static off_t tap_scan(TAPE *tap, off_t off, int (*accept)(char *, int))
+{
+	unsigned char *base = tap->tp_map, *end, *p, *q;
+	size_t len;
+	uint32_t n;
+
+	end = base + tap->tp_mapsize;
+	for (p = base + off; end - p >= 8; p++) {
+		if (!(len = tap_plausible(p, end, accept)))
+			continue;
+		q = p + len;
+		if (end - q >= 4) {
+			n = LE32(q);
+			if (n != 0 && n != 0xffffffff &&
+			    !tap_plausible(q, end, accept))
+				continue;
+		}
+		return p - base;
+	}
+	return -1;
+}
+
+
+/* resume reading at the next plausible block after the bad one */
+/* returns 0 if nothing found */
+static int tap_resync(TAPE *tap)
+{
+	off_t off;
+
+	if (!tap->tp_map) {
+		fprintf(stderr, "%s: can't resynchronize unless image "
+				"is mapped\n", tap->tp_path);
+		return 0;
+	}
+
+	off = tap_scan(tap, tap->tp_boff + 1, tap_recover);
+	if (off < 0) {
+		fprintf(stderr, "%s: no valid block after offset 0x%lx\n",
+			tap->tp_path, (long)tap->tp_boff);
+		return 0;
+	}
+
+	fprintf(stderr, "%s: resynchronized at offset 0x%lx, "
+			"%ld bytes skipped\n", tap->tp_path,
+		(long)off, (long)(off - tap->tp_boff));
+	tap->tp_off = off;
+	return 1;
+}
+
+
+/* Read next tape block, or skip over its data if bufp is NULL */
+/* when skipping, the last ntail bytes of data are copied to tail */
+/* returns block size, -1=end of tape, -2=error, e.g. out of memory */
+static ssize_t tap_block(TAPE *tap, char **bufp, char *tail, int ntail)
+{
+	unsigned char sbuf[4], *bp;
+	char lbuf[81];
+	int rv, toobig, nt;
 
 	if (tap->tp_status & TP_ERR)
 		return -2;
@@ -115,88 +1092,286 @@ ssize_t tap_readblock(TAPE *tap, char **bufp)
 	if (tap->tp_status & TP_EOM)
 		return -1;
 
+    next:
+	if (tap_iopolicy != TAP_IO_DEFAULT && tap->tp_fp)
+		tap_advise(tap);
+	tap->tp_boff = tap->tp_off;
+
 	/* read header */
-	rv = fread(sbuf, 1, 4, tap->tp_fp);
-	if (rv < 4) {
+	bp = tap_get(tap, sbuf, 4);
+	if (!bp) {
 		dprint(("%s: tap_readblock: EOF reading header at 0x%lx\n",
-			tap->tp_path, ftell(tap->tp_fp)));
+			tap->tp_path, (long)tap_tell(tap)));
+
+		/* a decompressor that failed looks like end of tape */
+		if (tap_reap(tap) < 0) {
+			tap->tp_status |= TP_ERR;
+			return -2;
+		}
+		if ((rv = tap_nextvol(tap)) > 0)
+			goto next;
 		tap->tp_status |= TP_EOM;
-		return -1;
+		return rv < 0 ? -2 : -1;
 	}
-	tap->tp_nbytes = LE32(sbuf);
+	tap->tp_nbytes = LE32(bp);
 	if (tap->tp_nbytes == 0xffffffff) {
 		dprint(("%s: tap_readblock: end-of-medium marker at 0x%lx\n",
-			tap->tp_path, ftell(tap->tp_fp)));
+			tap->tp_path, (long)tap_tell(tap)));
+		if ((rv = tap_nextvol(tap)) > 0)
+			goto next;
 		tap->tp_status |= TP_EOM;
-		return -1;
+		return rv < 0 ? -2 : -1;
 	}
 
 	/* Empty tape block indicates tapemark. No data or trailer to read */
-	if (tap->tp_nbytes == 0)
+	if (tap->tp_nbytes == 0) {
+		/* tapemark then EOV label: data continues on next volume */
+		if (tap->tp_vols && *tap->tp_vols &&
+		    tap_peek(tap, lbuf, 0) == 1 &&
+		    strncmp(lbuf, "EOV", 3) == 0 && tap_nextvol(tap) > 0)
+			goto next;
 		return 0;
+	}
 
-	/* read data */
-	tap->tp_buf = realloc(tap->tp_buf, tap->tp_nbytes);
-	if (!tap->tp_buf) {
-		fprintf(stderr, "%s: block size %u too large, offset 0x%lx\n",
-			tap->tp_path, tap->tp_nbytes, ftell(tap->tp_fp));
-		tap->tp_status |= TP_ERR;
-		return -2;
+	/* skip data if requested or block is oversized, else read it */
+	toobig = bufp && tap_maxblock && tap->tp_nbytes > tap_maxblock;
+	if (toobig)
+		fprintf(stderr, "%s: skipping %u-byte block at offset 0x%lx\n",
+			tap->tp_path, tap->tp_nbytes, (long)tap->tp_boff);
+	if (toobig || !bufp) {
+		/* ntail stays as given, for any block after a resync */
+		nt = MIN(ntail, tap->tp_nbytes);
+		bp = tap_skip(tap, tap->tp_nbytes - nt) < 0 ? NULL : sbuf;
+		if (bp && nt) {
+			bp = tap_get(tap, (unsigned char *)tail, nt);
+			if (bp && bp != (unsigned char *)tail)
+				memcpy(tail, bp, nt);
+		}
+		goto trailer;
+	}
+
+	/* grow buffer only if not mapped */
+	if (!tap->tp_map && tap->tp_nbytes > tap->tp_bufsize) {
+		free(tap->tp_buf);
+		tap->tp_bufsize = 0;
+		tap->tp_buf = malloc(tap->tp_nbytes);
+		if (!tap->tp_buf) {
+			fprintf(stderr,
+				"%s: block size %u too large, offset 0x%lx\n",
+				tap->tp_path, tap->tp_nbytes,
+				(long)tap_tell(tap));
+			tap->tp_status |= TP_ERR;
+			return -2;
+		}
+		tap->tp_bufsize = tap->tp_nbytes;
 	}
-	rv = fread(tap->tp_buf, 1, tap->tp_nbytes, tap->tp_fp);
-	if (rv != tap->tp_nbytes) {
+	bp = tap_get(tap, (unsigned char *)tap->tp_buf, tap->tp_nbytes);
+	*bufp = (char *)bp;
+
+    trailer:
+	if (!bp) {
 		fprintf(stderr, "%s: EOF reading %u bytes, offset 0x%lx\n",
-			tap->tp_path, tap->tp_nbytes, ftell(tap->tp_fp));
+			tap->tp_path, tap->tp_nbytes, (long)tap_tell(tap));
+
+		/* an oversized block is most likely a corrupt header */
+		if ((tap_recover || toobig) && tap_resync(tap))
+			goto next;
 		tap->tp_status |= TP_ERR;
 		return -2;
 	}
-	*bufp = tap->tp_buf;
 
 	/* read trailer */
-	rv = fread(sbuf, 1, 4, tap->tp_fp);
-	if (rv < 4) {
+	bp = tap_get(tap, sbuf, 4);
+	if (!bp) {
 		fprintf(stderr, "%s: EOF reading trailer at offset 0x%lx\n",
-			tap->tp_path, ftell(tap->tp_fp));
+			tap->tp_path, (long)tap_tell(tap));
 		tap->tp_status |= TP_EOM;
-		return tap->tp_nbytes;
+		return toobig ? -1 : tap->tp_nbytes;
 	}
 	if (tap->tp_nbytes & 1) {
 		/* Some tape images omit the required even-byte padding. */
-		if (tap->tp_nbytes == LE32(sbuf)) {
+		if (tap->tp_nbytes == LE32(bp)) {
 			dprint(("%s: tap_readblock: no padding at 0x%lx\n",
-				tap->tp_path, ftell(tap->tp_fp)));
+				tap->tp_path, (long)tap_tell(tap)));
+			if (toobig)
+				goto next;
 			return tap->tp_nbytes;
 		}
 
 		/* Conforming image: skip over padding byte. */
-		memmove(sbuf, sbuf+1, 3);
-		rv = fread(sbuf+3, 1, 1, tap->tp_fp);
-		if (rv < 1) {
+		memmove(sbuf, bp+1, 3);
+		bp = tap_get(tap, sbuf+3, 1);
+		if (!bp) {
 			fprintf(stderr,
 				"%s: EOF reading trailer, offset 0x%lx\n",
-				tap->tp_path, ftell(tap->tp_fp));
+				tap->tp_path, (long)tap_tell(tap));
 			tap->tp_status |= TP_EOM;
-			return tap->tp_nbytes;
+			return toobig ? -1 : tap->tp_nbytes;
 		}
+		sbuf[3] = *bp;
+		bp = sbuf;
 	}
-	if (tap->tp_nbytes != LE32(sbuf)) {
+	if (tap->tp_nbytes != LE32(bp)) {
 		fprintf(stderr, "%s: trailer size %u (offset 0x%lx) "
 				"doesn't match header size %u\n",
-			tap->tp_path, LE32(sbuf), ftell(tap->tp_fp),
+			tap->tp_path, LE32(bp), (long)tap_tell(tap),
 			tap->tp_nbytes);
+		if ((tap_recover || toobig) && tap_resync(tap))
+			goto next;
 		tap->tp_status |= TP_ERR;
+		return toobig ? -2 : tap->tp_nbytes;
 	}
 
+	if (toobig)
+		goto next;
 	return tap->tp_nbytes;
 }
 
 
+/* Read next tape block */
+/* returns block size, -1=end of tape, -2=error, e.g. out of memory */
+/* if image is mapped, *bufp points into the map and must not be modified */
+/* blocks larger than tap_maxblock (if set) are skipped with a warning; */
+/* if one proves to be a corrupt header, reading resumes at the next */
+/* plausible block, as with tap_recover */
+ssize_t tap_readblock(TAPE *tap, char **bufp)
+{
+	*bufp = NULL;
+
+	if (tap->tp_status & TP_WRITE) {
+		fprintf(stderr,
+			"%s: tap_readblock not allowed while writing tape",
+			tap->tp_path);
+		return -2;
+	}
+
+	return tap_block(tap, bufp, NULL, 0);
+}
+
+
+/* Skip next tape block without reading its data */
+/* its last ntail bytes, or all of it if shorter, are returned in tail */
+/* returns block size, -1=end of tape, -2=error */
+ssize_t tap_skipblock(TAPE *tap, char *tail, int ntail)
+{
+	if (tap->tp_status & TP_WRITE) {
+		fprintf(stderr,
+			"%s: tap_skipblock not allowed while writing tape",
+			tap->tp_path);
+		return -2;
+	}
+
+	return tap_block(tap, NULL, tail, ntail);
+}
+
+
+/* Reposition to offset, e.g. from tap_blocktab */
+/* returns -1 if image is not seekable */
+int tap_seek(TAPE *tap, off_t off)
+{
+	if (tap->tp_status & (TP_WRITE | TP_NOSEEK) || tap->tp_ra)
+		return -1;
+
+	if (tap->tp_map) {
+		if (off > tap->tp_mapsize)
+			return -1;
+	} else if (tap->tp_bs) {
+		if (off > tap->tp_size)
+			return -1;
+	} else if (fseeko(tap->tp_fp, off, SEEK_SET) < 0)
+		return -1;
+
+	tap->tp_off = off;
+	tap->tp_npre = 0;
+	tap->tp_status &= ~(TP_ERR | TP_EOM);
+	return 0;
+}
+
+
+/*
+ * Seek a mapped image to the first block at or after off that accept
+ * finds plausible, backing up over tapemarks just before it that are
+ * also at or after off.  *prevp gets the size of the block before that,
+ * 0 if it's a tapemark or the beginning of the tape.
+ * returns -1 if there is no such block
+ */
+int tap_sync(TAPE *tap, off_t off, int (*accept)(char *, int), long *prevp)
+{
+	unsigned char *base = tap->tp_map;
+	off_t boff;
+
+	if (!base) {
+		fprintf(stderr, "%s: can't synchronize unless image "
+				"is mapped\n", tap->tp_path);
+		return -1;
+	}
+
+	if ((boff = tap_scan(tap, off, accept)) < 0)
+		return -1;
+	while (boff - 4 >= off && boff >= 4 && LE32(base + boff - 4) == 0)
+		boff -= 4;
+
+	*prevp = boff >= 4 ? LE32(base + boff - 4) : 0;
+	dprint(("tap_sync: 0x%lx -> 0x%lx, previous block %ld\n",
+		(long)off, (long)boff, *prevp));
+	return tap_seek(tap, boff);
+}
+
+
+/*
+ * Build table of blocks from current position to end of tape by walking
+ * the SIMH header/trailer chain, skipping over block data.
+ * returns number of entries in *tabp (caller frees), -1 if out of memory
+ */
+ssize_t tap_blocktab(TAPE *tap, TAPBLK **tabp)
+{
+	TAPBLK *tab = NULL, *nt;
+	size_t n = 0, max = 0;
+	ssize_t nbytes;
+
+	while ((nbytes = tap_skipblock(tap, NULL, 0)) >= 0) {
+		if (n == max) {
+			max = max ? max * 2 : 4096;
+			nt = realloc(tab, max * sizeof(TAPBLK));
+			if (!nt) {
+				fprintf(stderr, "%s: tap_blocktab: "
+						"out of memory at %zu blocks\n",
+					tap->tp_path, n);
+				free(tab);
+				return -1;
+			}
+			tab = nt;
+		}
+		tab[n].bt_off = tap->tp_boff;
+		tab[n].bt_nbytes = nbytes;
+		tab[n].bt_kind = nbytes ? BT_DATA : BT_MARK;
+		n++;
+	}
+
+	/* note where the chain ended, and why */
+	nt = realloc(tab, (n + 1) * sizeof(TAPBLK));
+	if (!nt) {
+		free(tab);
+		return -1;
+	}
+	tab = nt;
+	tab[n].bt_off = tap->tp_boff;
+	tab[n].bt_nbytes = 0;
+	tab[n].bt_kind = nbytes == -1 ? BT_EOM : BT_ERR;
+
+	*tabp = tab;
+	return n + 1;
+}
+
+
 /* Write SIMH-format tape block */
+/* blocks are collected in tp_wbuf; one too big for it is written directly */
 /* returns bytes written inc. header/trailer, -1 if error */
 ssize_t tap_writeblock(TAPE *tap, char *buf, ssize_t nbytes)
 {
-	char len[4], pad = '\0';
-	ssize_t rv;
+	char len[4], pad = '\0', *wp;
+	struct iovec iov[4];
+	size_t total, size;
 
 	if (!(tap->tp_status & TP_WRITE)) {
 		fprintf(stderr,
@@ -204,28 +1379,60 @@ ssize_t tap_writeblock(TAPE *tap, char *buf, ssize_t nbytes)
 			tap->tp_path);
 		return (ssize_t) -1;
 	}
+	if (tap->tp_status & TP_ERR)
+		return (ssize_t) -1;
 
 	len[0] = nbytes & 0xff;
 	len[1] = (nbytes >> 8) & 0xff;
 	len[2] = (nbytes >> 16) & 0xff;
 	len[3] = (nbytes >> 24) & 0xff;
 
-	/* write header size */
-	rv = fwrite(len, 1, 4, tap->tp_fp);
+	/* header, data, pad, trailer; tapemark has only header */
+	total = nbytes ? 4 + nbytes + (nbytes & 1) + 4 : 4;
+	if (nbytes & 1)
+		dprint(("tap_writeblock: add pad, nbytes %ld\n", nbytes));
 
-	/* tapemark, don't write trail size */
-	if (nbytes == 0)
-		return rv;
+	/* make room: grow in-memory image, else write out buffer */
+	if (tap->tp_wlen + total > tap->tp_wsize) {
+		if (tap->tp_status & TP_MEM) {
+			size = MAX(tap->tp_wsize * 2, tap->tp_wlen + total);
+			wp = realloc(tap->tp_wbuf, size);
+			if (!wp) {
+				fprintf(stderr, "%s: out of memory at %lu "
+						"bytes\n", tap->tp_path,
+					(unsigned long)tap->tp_wlen);
+				tap->tp_status |= TP_ERR;
+				return (ssize_t) -1;
+			}
+			tap->tp_wbuf = wp;
+			tap->tp_wsize = size;
+		} else if (tap_flush(tap) < 0)
+			return (ssize_t) -1;
+	}
 
-	/* write data and pad */
-	rv += fwrite(buf, 1, nbytes, tap->tp_fp);
-	if (nbytes & 1) {
-		dprint(("tap_writeblock: add pad, nbytes %ld\n", nbytes));
-		rv += fwrite(&pad, 1, 1, tap->tp_fp);
+	if (total > tap->tp_wsize) {
+		iov[0].iov_base = len;
+		iov[0].iov_len = 4;
+		iov[1].iov_base = buf;
+		iov[1].iov_len = nbytes;
+		iov[2].iov_base = &pad;
+		iov[2].iov_len = nbytes & 1;
+		iov[3].iov_base = len;
+		iov[3].iov_len = 4;
+		if (tap_pwritev(tap, iov, 4) < 0)
+			return (ssize_t) -1;
+	} else {
+		wp = tap->tp_wbuf + tap->tp_wlen;
+		memcpy(wp, len, 4);
+		if (nbytes) {
+			memcpy(wp + 4, buf, nbytes);
+			if (nbytes & 1)
+				wp[4 + nbytes] = pad;
+			memcpy(wp + total - 4, len, 4);
+		}
+		tap->tp_wlen += total;
 	}
 
-	/* write trail size */
-	rv += fwrite(len, 1, 4, tap->tp_fp);
-	
-	return rv;
+	tap->tp_nblocks++;
+	return total;
 }
@@ -22,18 +22,82 @@
 #ifndef _SIMTAP_H
 #define _SIMTAP_H 1
 
+#include <time.h>
+#include <sys/types.h>
+#include "hash.h"
+
+struct tap_ra;
+struct blkstore;
+
 typedef struct {
 	FILE		*tp_fp;
 	char		*tp_path;
 	char		*tp_buf;	/* only for read mode */
 	uint32_t	tp_nbytes;	/* only for read mode */
+	uint32_t	tp_bufsize;	/* allocated size of tp_buf */
+	char		*tp_map;	/* mapped image, if any */
+	struct blkstore	*tp_bs;		/* image in a block store, if any */
+	off_t		tp_mapsize;
+	off_t		tp_off;		/* offset of next byte to read */
+	off_t		tp_advised;	/* I/O policy applied up to here */
+	off_t		tp_boff;	/* offset of last block read */
+	off_t		tp_size;	/* image size, 0 if not a regular file */
+	struct tap_ra	*tp_ra;		/* read-ahead thread, if any */
+	pid_t		tp_pid;		/* decompressor process, if any */
+	pid_t		tp_fpid;	/* process feeding it a pipe, if any */
+	char		tp_pre[96];	/* bytes to return before tp_fp's */
+	int		tp_npre;
+	char		**tp_vols;	/* volumes still to read, if a set */
+	int		tp_volno;	/* volume being read, from 0 */
+	char		*tp_wbuf;	/* only for write mode: blocks not */
+	size_t		tp_wlen;	/*  yet written at tp_off, or */
+	size_t		tp_wsize;	/*  whole image if in memory */
+	off_t		tp_alloc;	/* preallocated to here, -1=can't */
+	unsigned long	tp_nblocks;	/* blocks written */
+	struct timespec	tp_start;	/* when opened for writing */
+	hash_t		*tp_hash;	/* hashes what's written, if set */
 	uint8_t		tp_status;
 } TAPE;
 
+/* block table entry, see tap_blocktab */
+typedef struct {
+	off_t		bt_off;		/* offset of SIMH header */
+	uint32_t	bt_nbytes;	/* data bytes, 0 if not BT_DATA */
+	uint8_t		bt_kind;
+} TAPBLK;
+
+#define BT_DATA		0
+#define BT_MARK		1	/* tapemark */
+#define BT_EOM		2	/* end of medium, always last */
+#define BT_ERR		3	/* unreadable, always last */
+
+/* I/O policies for reading */
+#define TAP_IO_DEFAULT	0	/* mapped or stdio, no hints */
+#define TAP_IO_SEQ	1	/* sequential read-ahead hints */
+#define TAP_IO_DROP	2	/* also drop cached pages behind cursor */
+#define TAP_IO_DIRECT	3	/* O_DIRECT reads, bypass page cache */
+
+extern int tap_qdepth;
+extern int tap_iopolicy;
+extern uint32_t tap_maxblock;
+extern int tap_follow;
+extern int tap_prealloc;
+extern int (*tap_recover)(char *buf, int nbytes);
+
 extern TAPE *tap_open(char *path, char *fname);
+extern TAPE *tap_memopen(char *buf, size_t len, char *name);
+extern char *tap_membuf(TAPE *tap, size_t *lenp);
 extern void tap_close(TAPE *tap);
 extern int tap_is_write(TAPE *tap);
+extern void tap_setvols(TAPE *tap, char **vols);
+extern off_t tap_tell(TAPE *tap);
 extern ssize_t tap_readblock(TAPE *tap, char **bufp);
+extern ssize_t tap_skipblock(TAPE *tap, char *tail, int ntail);
+extern int tap_peekblock(TAPE *tap, char *lbuf);
+extern int tap_seek(TAPE *tap, off_t off);
+extern int tap_sync(TAPE *tap, off_t off, int (*accept)(char *, int),
+		    long *prevp);
+extern ssize_t tap_blocktab(TAPE *tap, TAPBLK **tabp);
 extern ssize_t tap_writeblock(TAPE *tap, char *buf, ssize_t nbytes);
 
 #endif /* _SIMTAP_H */
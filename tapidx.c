@@ -0,0 +1,299 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Sidecar index of the blocks and records of a tape image.
+ *
+ * The index is kept next to the image as "image.idx".  It records the
+ * image's size, mtime and a hash of samples of its contents, and is
+ * ignored if any of them no longer match, or if it lacks the record
+ * hashes asked for.  It is a private cache, so entries are stored in
+ * host byte order.
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ansi.h"
+#include "cdctap.h"
+#include "dcode.h"
+#include "ifmt.h"
+#include "tapidx.h"
+
+#define IDX_MAGIC	"CDCTIDX2"
+#define IDX_NSAMPLE	64		/* chunks of image hashed */
+#define IDX_SAMPLE	4096
+
+typedef struct {
+	char		ih_magic[8];
+	uint32_t	ih_entsize;	/* sizeof(idxent_t) */
+	uint32_t	ih_digests;	/* HASH_ flags */
+	uint32_t	ih_dc063;	/* dcmap[063] the text was shown with */
+	uint64_t	ih_nent;
+	int64_t		ih_size;
+	int64_t		ih_mtime;
+	int64_t		ih_mnsec;
+	uint64_t	ih_hash;
+} idxhdr_t;
+
+
+/* FNV-1a over IDX_NSAMPLE evenly spaced chunks, first and last included */
+static int idx_hash(int fd, off_t size, uint64_t *hashp)
+{
+	char buf[IDX_SAMPLE];
+	uint64_t h = 0xcbf29ce484222325ULL;
+	off_t off, step;
+	ssize_t n;
+	int i, j;
+
+	step = size > IDX_SAMPLE ? (size - IDX_SAMPLE) / (IDX_NSAMPLE - 1) : 0;
+	for (i = 0; i < IDX_NSAMPLE; i++) {
+		off = step * i;
+		n = pread(fd, buf, sizeof buf, off);
+		if (n < 0)
+			return -1;
+		for (j = 0; j < n; j++) {
+			h ^= (unsigned char)buf[j];
+			h *= 0x100000001b3ULL;
+		}
+		if (!step)
+			break;
+	}
+	*hashp = h;
+	return 0;
+}
+
+
+/* returns empty index of tap's image, to be filled by idx_add */
+/* NULL if the image can't be indexed */
+tapidx_t *idx_new(TAPE *tap)
+{
+	tapidx_t *ix;
+	struct stat st;
+	int fd;
+
+	/* only a single volume in a regular file, read once through */
+	if (tap_is_write(tap) || tap_follow || tap->tp_vols && *tap->tp_vols ||
+	    strcmp(tap->tp_path, "-") == 0)
+		return NULL;
+
+	fd = open(tap->tp_path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	ix = calloc(1, sizeof(tapidx_t));
+	if (!ix || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		goto fail;
+	ix->ix_size = st.st_size;
+	ix->ix_mtime = st.st_mtim.tv_sec;
+	ix->ix_mnsec = st.st_mtim.tv_nsec;
+	ix->ix_digests = cdc_hashing;
+	if (idx_hash(fd, st.st_size, &ix->ix_hash) < 0)
+		goto fail;
+
+	ix->ix_path = malloc(strlen(tap->tp_path) + 5);
+	if (!ix->ix_path)
+		goto fail;
+	sprintf(ix->ix_path, "%s.idx", tap->tp_path);
+	close(fd);
+	return ix;
+
+    fail:
+	free(ix);
+	close(fd);
+	return NULL;
+}
+
+
+/* returns index of tap's image if there is one and it is current */
+tapidx_t *idx_load(TAPE *tap)
+{
+	tapidx_t *ix;
+	idxhdr_t ih;
+	FILE *fp;
+
+	if (!(ix = idx_new(tap)))
+		return NULL;
+	if (!(fp = fopen(ix->ix_path, "r"))) {
+		idx_free(ix);
+		return NULL;
+	}
+
+	if (fread(&ih, sizeof ih, 1, fp) != 1 ||
+	    memcmp(ih.ih_magic, IDX_MAGIC, sizeof ih.ih_magic) != 0 ||
+	    ih.ih_entsize != sizeof(idxent_t) ||
+	    ih.ih_size != ix->ix_size || ih.ih_mtime != ix->ix_mtime ||
+	    ih.ih_mnsec != ix->ix_mnsec || ih.ih_hash != ix->ix_hash) {
+		dprint(("idx_load: %s is stale\n", ix->ix_path));
+		goto fail;
+	}
+	/* names and text are cached as shown, so -3 needs its own */
+	if (ih.ih_dc063 != (unsigned char)dcmap[063]) {
+		dprint(("idx_load: %s is for the other character set\n",
+			ix->ix_path));
+		goto fail;
+	}
+	if (cdc_hashing & ~ih.ih_digests) {
+		dprint(("idx_load: %s lacks hashes\n", ix->ix_path));
+		goto fail;
+	}
+	ix->ix_digests = ih.ih_digests;
+
+	ix->ix_nent = ix->ix_max = ih.ih_nent;
+	ix->ix_ent = malloc(ih.ih_nent * sizeof(idxent_t) + 1);
+	if (!ix->ix_ent ||
+	    fread(ix->ix_ent, sizeof(idxent_t), ih.ih_nent, fp) != ih.ih_nent) {
+		dprint(("idx_load: %s is short\n", ix->ix_path));
+		goto fail;
+	}
+
+	dprint(("idx_load: %s: %lu entries\n", ix->ix_path,
+		(unsigned long)ix->ix_nent));
+	fclose(fp);
+	return ix;
+
+    fail:
+	fclose(fp);
+	idx_free(ix);
+	return NULL;
+}
+
+
+void idx_add(tapidx_t *ix, idxent_t *ie)
+{
+	idxent_t *ne;
+	size_t max;
+
+	if (!ix || ix->ix_bad)
+		return;
+
+	if (ix->ix_nent == ix->ix_max) {
+		max = ix->ix_max ? ix->ix_max * 2 : 1024;
+		ne = realloc(ix->ix_ent, max * sizeof(idxent_t));
+		if (!ne) {
+			ix->ix_bad = 1;
+			return;
+		}
+		ix->ix_ent = ne;
+		ix->ix_max = max;
+	}
+	ix->ix_ent[ix->ix_nent++] = *ie;
+}
+
+
+/* add every tapemark, label and record from here to end of tape */
+/* returns 0 if the whole tape was read, -1 if not */
+int idx_scan(tapidx_t *ix, TAPE *tap)
+{
+	ssize_t nbytes;
+	char *tbuf, *cbuf;
+	cdc_ctx_t cd;
+	idxent_t ie;
+	int nchar, ui;
+
+	while ((nbytes = tap_readblock(tap, &tbuf)) >= 0) {
+		memset(&ie, 0, sizeof ie);
+		ie.ie_off = tap->tp_boff;
+		ie.ie_end = tap_tell(tap);
+		ie.ie_nblocks = 1;
+
+		if (nbytes == 0)
+			ie.ie_kind = IE_MARK;
+		else if (is_label(tbuf, nbytes, ie.ie_text))
+			ie.ie_kind = IE_LABEL;
+		else {
+			nchar = cdc_ctx_init(&cd, tap, tbuf, nbytes, &cbuf);
+			if (nchar == -2)
+				return -1;
+			ie.ie_kind = IE_REC;
+			ie.ie_rt = id_record(cbuf, nchar, ie.ie_name,
+					     ie.ie_date, ie.ie_text, &ui);
+			ie.ie_ui = ui;
+			ie.ie_reclen = cdc_skipr(&cd);
+			(void) cdc_digest(&cd, &ie.ie_digest);
+			ie.ie_nblocks = MAX(cd.cd_nblocks, 1);
+			ie.ie_end = tap_tell(tap);
+			cdc_ctx_fini(&cd);
+		}
+		idx_add(ix, &ie);
+	}
+	return nbytes == -2 ? -1 : 0;
+}
+
+
+/* write index beside the image; it's only a cache, so failure is quiet */
+/* returns 0 if written */
+int idx_save(tapidx_t *ix)
+{
+	idxhdr_t ih;
+	char *tmp;
+	FILE *fp;
+	int ok;
+
+	if (ix->ix_bad)
+		return -1;
+
+	memset(&ih, 0, sizeof ih);
+	memcpy(ih.ih_magic, IDX_MAGIC, sizeof ih.ih_magic);
+	ih.ih_entsize = sizeof(idxent_t);
+	ih.ih_digests = ix->ix_digests;
+	ih.ih_dc063 = (unsigned char)dcmap[063];
+	ih.ih_nent = ix->ix_nent;
+	ih.ih_size = ix->ix_size;
+	ih.ih_mtime = ix->ix_mtime;
+	ih.ih_mnsec = ix->ix_mnsec;
+	ih.ih_hash = ix->ix_hash;
+
+	/* write under a temporary name so a reader never sees half of it */
+	tmp = malloc(strlen(ix->ix_path) + 5);
+	if (!tmp)
+		return -1;
+	sprintf(tmp, "%s.tmp", ix->ix_path);
+	if (!(fp = fopen(tmp, "w"))) {
+		dprint(("idx_save: can't create %s\n", tmp));
+		free(tmp);
+		return -1;
+	}
+	ok = fwrite(&ih, sizeof ih, 1, fp) == 1 &&
+	     fwrite(ix->ix_ent, sizeof(idxent_t), ix->ix_nent, fp) ==
+	     ix->ix_nent;
+	if (fclose(fp) != 0 || !ok || rename(tmp, ix->ix_path) < 0) {
+		dprint(("idx_save: can't write %s\n", ix->ix_path));
+		(void) unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+
+	dprint(("idx_save: %s: %lu entries\n", ix->ix_path,
+		(unsigned long)ix->ix_nent));
+	free(tmp);
+	return 0;
+}
+
+
+void idx_free(tapidx_t *ix)
+{
+	if (!ix)
+		return;
+	free(ix->ix_ent);
+	free(ix->ix_path);
+	free(ix);
+}
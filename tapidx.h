@@ -0,0 +1,68 @@
+/*
+ * Copyright 2025 Andrew B. Hastings. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Sidecar index of the blocks and records of a tape image.
+ */
+
+#ifndef _TAPIDX_H
+#define _TAPIDX_H 1
+
+#include "hash.h"
+#include "rectype.h"
+#include "simtap.h"
+
+/* one tapemark, label or record, in tape order */
+typedef struct {
+	off_t		ie_off;		/* offset of first block */
+	off_t		ie_end;		/* offset past last block */
+	uint32_t	ie_nblocks;
+	int32_t		ie_reclen;	/* record size in CDC words */
+	int32_t		ie_ui;
+	uint8_t		ie_kind;
+	uint8_t		ie_rt;		/* rectype_t */
+	char		ie_name[8];
+	char		ie_date[11];
+	char		ie_text[EXTRA_LEN+1];	/* extra, or label */
+	digest_t	ie_digest;	/* of record, if ix_digests */
+} idxent_t;
+
+#define IE_MARK		0
+#define IE_LABEL	1
+#define IE_REC		2
+
+typedef struct {
+	char		*ix_path;	/* index file */
+	idxent_t	*ix_ent;
+	size_t		ix_nent;
+	size_t		ix_max;
+	int		ix_bad;		/* out of memory, don't save */
+	off_t		ix_size;	/* image size, mtime, sampled hash */
+	int64_t		ix_mtime;
+	int64_t		ix_mnsec;
+	uint64_t	ix_hash;
+	int		ix_digests;	/* HASH_ flags of records' digests */
+} tapidx_t;
+
+extern tapidx_t *idx_load(TAPE *tap);
+extern tapidx_t *idx_new(TAPE *tap);
+extern void idx_add(tapidx_t *ix, idxent_t *ie);
+extern int idx_scan(tapidx_t *ix, TAPE *tap);
+extern int idx_save(tapidx_t *ix);
+extern void idx_free(tapidx_t *ix);
+
+#endif /* _TAPIDX_H */